@@ -0,0 +1,212 @@
+/**
+ * \file src/catalog.cc
+ * \ingroup catalog
+ *
+ * Persistent cache of the OpusTags packets of the listed files.
+ */
+
+#include <opustags.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Magic signature at the beginning of catalog files, including a format version number. */
+static const ot::byte_string_view catalog_magic = "OTCATLG1"sv;
+
+/** Size of the fixed part of an entry, before the packet. */
+static constexpr size_t entry_header_size = 4 * 8 + 3 * 4;
+
+/** Flag of the entries whose covers were summarized. */
+static constexpr uint32_t summarized_flag = 1;
+
+std::optional<ot::catalog_key> ot::get_catalog_key(const char* path)
+{
+	struct stat info;
+	if (stat(path, &info) == -1 || !S_ISREG(info.st_mode))
+		return {};
+	return catalog_key {info.st_dev, info.st_ino, info.st_size, get_file_timestamp(info)};
+}
+
+static uint64_t read_u64(const char* data)
+{
+	uint64_t value;
+	memcpy(&value, data, 8);
+	return le64toh(value);
+}
+
+static uint32_t read_u32(const char* data)
+{
+	uint32_t value;
+	memcpy(&value, data, 4);
+	return le32toh(value);
+}
+
+static void append_u64(ot::byte_string& out, uint64_t value)
+{
+	value = htole64(value);
+	out.append(reinterpret_cast<const char*>(&value), 8);
+}
+
+static void append_u32(ot::byte_string& out, uint32_t value)
+{
+	value = htole32(value);
+	out.append(reinterpret_cast<const char*>(&value), 4);
+}
+
+void ot::catalog::load(const char* path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT)
+		return;
+	if (fd == -1)
+		throw status {st::standard_error,
+		              "Could not open the catalog '"s + path + "': " + strerror(errno)};
+	file_mapping mapping;
+	bool mapped = mapping.map(fd);
+	close(fd);
+	byte_string_view data = mapping.data();
+	if (!mapped || !data.starts_with(catalog_magic))
+		throw status {st::bad_catalog, "'"s + path + "' is not a valid catalog."};
+	data.remove_prefix(catalog_magic.size());
+
+	std::lock_guard lock(mutex);
+	while (!data.empty()) {
+		if (data.size() < entry_header_size)
+			throw status {st::bad_catalog, "Truncated entry in catalog '"s + path + "'."};
+		std::pair<dev_t, ino_t> id(read_u64(data.data()), read_u64(data.data() + 8));
+		entry e;
+		e.size = read_u64(data.data() + 16);
+		e.mtime.tv_sec = read_u64(data.data() + 24);
+		e.mtime.tv_nsec = read_u32(data.data() + 32);
+		size_t packet_size = read_u32(data.data() + 36);
+		e.summarized = (read_u32(data.data() + 40) & summarized_flag) != 0;
+		e.seen = false;
+		data.remove_prefix(entry_header_size);
+		if (data.size() < packet_size)
+			throw status {st::bad_catalog, "Truncated entry in catalog '"s + path + "'."};
+		e.packet = data.substr(0, packet_size);
+		data.remove_prefix(packet_size);
+		entries.insert_or_assign(id, std::move(e));
+	}
+}
+
+void ot::catalog::save(const char* path)
+{
+	std::lock_guard lock(mutex);
+	if (!modified)
+		return;
+	partial_file output;
+	output.open(path);
+	byte_string buffer(catalog_magic);
+	for (const auto& [id, e] : entries) {
+		append_u64(buffer, id.first);
+		append_u64(buffer, id.second);
+		append_u64(buffer, e.size);
+		append_u64(buffer, e.mtime.tv_sec);
+		append_u32(buffer, e.mtime.tv_nsec);
+		append_u32(buffer, e.packet.size());
+		append_u32(buffer, e.summarized ? summarized_flag : 0);
+		buffer += e.packet;
+		// Flush the buffer every now and then rather than building the whole file in memory.
+		if (buffer.size() >= 65536) {
+			if (fwrite(buffer.data(), 1, buffer.size(), output.get()) < buffer.size())
+				throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
+			buffer.clear();
+		}
+	}
+	if (fwrite(buffer.data(), 1, buffer.size(), output.get()) < buffer.size())
+		throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
+	if (fflush(output.get()) != 0)
+		throw status {st::standard_error, "fflush error: "s + strerror(errno)};
+	output.commit();
+	modified = false;
+}
+
+void ot::catalog::prune()
+{
+	std::lock_guard lock(mutex);
+	if (std::erase_if(entries, [](const auto& item) { return !item.second.seen; }) != 0)
+		modified = true;
+}
+
+/** Tell whether the entry was made from the same version of the file as the key. */
+static bool is_fresh(const ot::catalog_key& key, off_t size, const timespec& mtime)
+{
+	return size == key.size && mtime.tv_sec == key.mtime.tv_sec &&
+	       mtime.tv_nsec == key.mtime.tv_nsec;
+}
+
+const ot::catalog::entry* ot::catalog::lookup(const catalog_key& key) const
+{
+	auto it = entries.find({key.device, key.inode});
+	if (it == entries.end() || !is_fresh(key, it->second.size, it->second.mtime))
+		return nullptr;
+	it->second.seen = true;
+	return &it->second;
+}
+
+std::optional<ot::byte_string> ot::catalog::find(const catalog_key& key, bool with_covers) const
+{
+	std::lock_guard lock(mutex);
+	const entry* e = lookup(key);
+	if (e == nullptr || (e->summarized && with_covers))
+		return {};
+	return e->packet;
+}
+
+bool ot::catalog::contains(const catalog_key& key, bool with_covers) const
+{
+	std::lock_guard lock(mutex);
+	const entry* e = lookup(key);
+	return e != nullptr && !(e->summarized && with_covers);
+}
+
+static const std::u8string_view cover_prefix = u8"METADATA_BLOCK_PICTURE="sv;
+
+/**
+ * Cut the cover arts of the packet after the fields of their picture block, keeping the MIME type
+ * and the size of the picture. Return nothing if there was nothing to cut, or if the packet cannot
+ * be parsed, in which case it is better stored as is.
+ */
+static std::optional<ot::byte_string> summarize_covers(ot::byte_string_view packet)
+{
+	try {
+		ot::opus_tags tags = ot::parse_tags_view(packet);
+		bool summarized = false;
+		ot::opus_tags summary;
+		summary.vendor = tags.vendor;
+		summary.extra_data = tags.extra_data;
+		for (std::u8string_view comment : tags.comments) {
+			if (comment.starts_with(cover_prefix)) {
+				std::u8string_view value = comment.substr(cover_prefix.size());
+				size_t kept = cover_prefix.size() + (ot::cover_view(value).picture_offset + 2) / 3 * 4;
+				if (kept < comment.size()) {
+					comment = comment.substr(0, kept);
+					summarized = true;
+				}
+			}
+			summary.comments.push_back(comment);
+		}
+		if (!summarized)
+			return {};
+		ot::dynamic_ogg_packet rendered = ot::render_tags(summary);
+		return ot::byte_string(reinterpret_cast<const char*>(rendered.packet), rendered.bytes);
+	} catch (const ot::status&) {
+		return {};
+	}
+}
+
+void ot::catalog::store(const catalog_key& key, byte_string_view packet)
+{
+	std::optional<byte_string> summary = summarize_covers(packet);
+	if (summary)
+		packet = *summary;
+	if (packet.size() > UINT32_MAX)
+		return; // Not worth caching, and not representable anyway.
+	std::lock_guard lock(mutex);
+	entries.insert_or_assign({key.device, key.inode},
+	                         entry {key.size, key.mtime, byte_string(packet), summary.has_value(), true});
+	modified = true;
+}
@@ -8,7 +8,9 @@
 
 #include <opustags.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -16,13 +18,17 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 static const char help_message[] =
 PROJECT_NAME " version " PROJECT_VERSION
 R"raw(
 
 Usage: opustags --help
-       opustags [OPTIONS] FILE
+       opustags [OPTIONS] FILE...
        opustags OPTIONS -i FILE...
        opustags OPTIONS FILE -o FILE
 
@@ -42,11 +48,32 @@ Options:
   --vendor                      print the vendor string
   --set-vendor VALUE            set the vendor string
   --raw                         disable encoding conversion
+  --padding SIZE                reserve SIZE bytes of padding in the comment header
+  -j, --jobs N                  process N files concurrently
+  -R, --recursive               process the Opus files found in directories
+  --follow-symlinks             follow symbolic links with --recursive
+  --catalog FILE                cache the listed tags in FILE
+  --prune-catalog               forget the files not listed from the catalog
+  --json                        print the tags as JSON
+  -H, --with-filename           prefix the listed tags with the file name
+  --match FIELD[=VALUE]         print the files having a matching comment
+  --match-prefix FIELD=PREFIX   print the files having a comment starting with PREFIX
+  --verify                      check the integrity of the files
+  --link N|all                  select the links of a chained stream
   -z                            delimit tags with NUL
 
 See the man page for extensive documentation.
 )raw";
 
+/** Upper bound for --jobs, which mostly serves to catch typos. */
+static constexpr unsigned long max_jobs = 1024;
+
+/**
+ * Upper bound for --padding. The padding is allocated for every file, and a few kilobytes are
+ * plenty for later edits, so larger values are most likely mistakes.
+ */
+static constexpr unsigned long max_padding = 1 << 20;
+
 static struct option getopt_options[] = {
 	{"help", no_argument, 0, 'h'},
 	{"output", required_argument, 0, 'o'},
@@ -63,6 +90,18 @@ static struct option getopt_options[] = {
 	{"vendor", no_argument, 0, 'v'},
 	{"set-vendor", required_argument, 0, 'V'},
 	{"raw", no_argument, 0, 'r'},
+	{"padding", required_argument, 0, 'p'},
+	{"jobs", required_argument, 0, 'j'},
+	{"recursive", no_argument, 0, 'R'},
+	{"follow-symlinks", no_argument, 0, 'L'},
+	{"catalog", required_argument, 0, 'K'},
+	{"prune-catalog", no_argument, 0, 'P'},
+	{"json", no_argument, 0, 'J'},
+	{"with-filename", no_argument, 0, 'H'},
+	{"match", required_argument, 0, 'm'},
+	{"match-prefix", required_argument, 0, 'M'},
+	{"verify", no_argument, 0, 'T'},
+	{"link", required_argument, 0, 'k'},
 	{NULL, 0, 0, 0}
 };
 
@@ -73,15 +112,19 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 	ot::status rc;
 	std::list<std::string> local_to_add; // opt.to_add before UTF-8 conversion.
 	std::list<std::string> local_to_delete; // opt.to_delete before UTF-8 conversion.
+	std::list<std::pair<std::string, bool>> local_matches; // opt.matches before UTF-8 conversion.
 	bool set_all = false;
 	std::optional<std::string> set_cover;
 	std::optional<std::string> set_vendor;
+	char* end;
+	unsigned long jobs;
+	unsigned long link;
 	opt = {};
 	if (argc == 1)
 		throw status {st::bad_arguments, "No arguments specified. Use -h for help."};
 	int c;
 	optind = 0;
-	while ((c = getopt_long(argc, argv, ":ho:iyd:a:s:DSez", getopt_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, ":ho:iyd:a:s:DSezj:RH", getopt_options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			opt.print_help = true;
@@ -144,6 +187,62 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 		case 'z':
 			opt.tag_delimiter = '\0';
 			break;
+		case 'p':
+			errno = 0;
+			opt.padding = strtoul(optarg, &end, 10);
+			if (errno != 0 || !isdigit(static_cast<unsigned char>(*optarg)) || *end != '\0' ||
+			    *opt.padding > max_padding)
+				throw status {st::bad_arguments, "Invalid padding size: "s + optarg + "."};
+			break;
+		case 'j':
+			errno = 0;
+			jobs = strtoul(optarg, &end, 10);
+			if (errno != 0 || !isdigit(static_cast<unsigned char>(*optarg)) || *end != '\0' ||
+			    jobs == 0 || jobs > max_jobs)
+				throw status {st::bad_arguments, "Invalid number of jobs: "s + optarg + "."};
+			opt.jobs = jobs;
+			break;
+		case 'R':
+			opt.recursive = true;
+			break;
+		case 'L':
+			opt.follow_symlinks = true;
+			break;
+		case 'J':
+			opt.json = true;
+			break;
+		case 'H':
+			opt.with_filename = true;
+			break;
+		case 'm':
+		case 'M':
+			if (c == 'M' && strchr(optarg, '=') == nullptr)
+				throw status {st::bad_arguments, "Prefix selector does not contain an equal sign: "s + optarg + "."};
+			local_matches.emplace_back(optarg, c == 'M');
+			break;
+		case 'T':
+			opt.verify = true;
+			break;
+		case 'k':
+			if (strcmp(optarg, "all") == 0) {
+				opt.link = 0;
+				break;
+			}
+			errno = 0;
+			link = strtoul(optarg, &end, 10);
+			if (errno != 0 || !isdigit(static_cast<unsigned char>(*optarg)) || *end != '\0' ||
+			    link == 0 || link > UINT_MAX)
+				throw status {st::bad_arguments, "Invalid link: "s + optarg + "."};
+			opt.link = link;
+			break;
+		case 'K':
+			if (opt.catalog_path)
+				throw status {st::bad_arguments, "Cannot specify --catalog more than once."};
+			opt.catalog_path = optarg;
+			break;
+		case 'P':
+			opt.prune_catalog = true;
+			break;
 		case ':':
 			throw status {st::bad_arguments, "Missing value for option '"s + argv[optind - 1] + "'."};
 		default:
@@ -181,6 +280,8 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 			       std::back_inserter(opt.to_delete), cast_to_utf8);
 		if (set_vendor)
 			opt.set_vendor = cast_to_utf8(*set_vendor);
+		for (const auto& [selector, prefix] : local_matches)
+			opt.matches.emplace_back(cast_to_utf8(selector), prefix);
 	} else {
 		try {
 			std::transform(local_to_add.begin(), local_to_add.end(),
@@ -189,6 +290,8 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 			               std::back_inserter(opt.to_delete), encode_utf8);
 			if (set_vendor)
 				opt.set_vendor = encode_utf8(*set_vendor);
+			for (const auto& [selector, prefix] : local_matches)
+				opt.matches.emplace_back(encode_utf8(selector), prefix);
 		} catch (const ot::status& rc) {
 			throw status {st::bad_arguments, "Could not encode argument into UTF-8: " + rc.message};
 		}
@@ -202,9 +305,18 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 	if (opt.in_place && stdin_as_input)
 		throw status {st::bad_arguments, "Cannot modify standard input in place."};
 
-	if ((!opt.in_place || opt.edit_interactively) && opt.paths_in.size() != 1)
+	if (read_only && opt.paths_in.empty())
+		throw status {st::bad_arguments, "At least one input file must be specified."};
+
+	if ((opt.path_out || opt.edit_interactively) && opt.paths_in.size() != 1)
 		throw status {st::bad_arguments, "Exactly one input file must be specified."};
 
+	if (opt.recursive && opt.path_out)
+		throw status {st::bad_arguments, "Cannot use --recursive with --output."};
+
+	if (opt.edit_interactively && opt.recursive)
+		throw status {st::bad_arguments, "Cannot mix --edit with --recursive."};
+
 	if (opt.edit_interactively && (stdin_as_input || opt.path_out == "-" || opt.cover_out == "-"))
 		throw status {st::bad_arguments, "Cannot edit interactively when standard input or standard output are already used."};
 
@@ -223,10 +335,50 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 	if (opt.print_vendor && !read_only)
 		throw status {st::bad_arguments, "--vendor is only supported in read-only mode."};
 
+	if (opt.json && !read_only)
+		throw status {st::bad_arguments, "--json is only supported in read-only mode."};
+
+	if (opt.json && opt.print_vendor)
+		throw status {st::bad_arguments, "Cannot mix --json with --vendor."};
+
+	if (opt.catalog_path && !read_only)
+		throw status {st::bad_arguments, "--catalog is only supported in read-only mode."};
+
+	if (opt.prune_catalog && !opt.catalog_path)
+		throw status {st::bad_arguments, "--prune-catalog requires --catalog."};
+
+	if (opt.with_filename && !read_only)
+		throw status {st::bad_arguments, "--with-filename is only supported in read-only mode."};
+
+	if (!opt.matches.empty() && !read_only)
+		throw status {st::bad_arguments, "--match is only supported in read-only mode."};
+
+	if (!opt.matches.empty() && (opt.json || opt.print_vendor || opt.cover_out))
+		throw status {st::bad_arguments, "Cannot mix --match with --json, --vendor or --output-cover."};
+
+	if (!opt.matches.empty() &&
+	    (opt.delete_all || !opt.to_add.empty() || !opt.to_delete.empty() || set_vendor || set_cover))
+		throw status {st::bad_arguments, "Cannot mix --match with tag edition."};
+
+	if (opt.verify && !read_only)
+		throw status {st::bad_arguments, "--verify is only supported in read-only mode."};
+
+	if (opt.verify && (opt.json || opt.print_vendor || opt.cover_out || !opt.matches.empty() || opt.catalog_path))
+		throw status {st::bad_arguments, "Cannot mix --verify with --json, --vendor, --match, --catalog or --output-cover."};
+
+	if (opt.verify &&
+	    (opt.delete_all || !opt.to_add.empty() || !opt.to_delete.empty() || set_vendor || set_cover))
+		throw status {st::bad_arguments, "Cannot mix --verify with tag edition."};
+
+	if (opt.link && (opt.verify || !opt.matches.empty() || opt.catalog_path))
+		throw status {st::bad_arguments, "Cannot mix --link with --verify, --match or --catalog."};
+
+	if (read_only && (opt.paths_in.size() > 1 || opt.recursive))
+		opt.with_filename = true;
+
 	if (set_cover) {
-		byte_string picture_data = ot::slurp_binary_file(set_cover->c_str());
 		opt.to_delete.push_back(u8"METADATA_BLOCK_PICTURE"s);
-		opt.to_add.push_back(ot::make_cover(picture_data));
+		opt.cover_to_add = ot::make_cover(std::make_shared<file_contents>(set_cover->c_str()));
 	}
 
 	if (set_all) {
@@ -239,14 +391,14 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 
 /** Format a UTF-8 string by adding tabulations (\t) after line feeds (\n) to mark continuation for
  *  multiline values. With -z, this behavior applies for embedded NUL characters instead of LF. */
-static std::u8string format_value(const std::u8string& source, const ot::options& opt)
+static std::u8string format_value(std::u8string_view source, const ot::options& opt)
 {
 	auto newline_count = std::count(source.begin(), source.end(), opt.tag_delimiter);
 
 	// General case: the value fits on a single line. Use std::string’s copy constructor for the
 	// most efficient copy we could hope for.
 	if (newline_count == 0)
-		return source;
+		return std::u8string(source);
 
 	std::u8string formatted;
 	formatted.reserve(source.size() + newline_count);
@@ -278,29 +430,201 @@ static void puts_utf8(std::u8string_view str, FILE* output, const ot::options& o
 	putc(opt.tag_delimiter, output);
 }
 
+/** Tell whether the comment contains control characters other than line feeds. */
+static bool has_control_characters(std::u8string_view comment)
+{
+	return std::any_of(comment.begin(), comment.end(), [](unsigned char c) {
+		return c < 0x20 && c != '\n';
+	});
+}
+
+static void warn_control_characters()
+{
+	fputs("warning: Some tags contain control characters.\n", ot::thread_stderr);
+}
+
+/** Print a single comment in the format of #ot::print_comments. */
+static void print_comment(std::u8string_view comment, FILE* output, const ot::options& opt)
+{
+	puts_utf8(format_value(comment, opt), output, opt);
+}
+
 /**
  * Print comments in a human readable format that can also be read back in by #read_comment.
  *
  * To disambiguate between a newline embedded in a comment and a newline representing the start of
  * the next tag, continuation lines always have a single TAB (^I) character added to the beginning.
  */
-void ot::print_comments(const std::list<std::u8string>& comments, FILE* output, const ot::options& opt)
+void ot::print_comments(const comment_list& comments, FILE* output, const ot::options& opt)
 {
 	bool has_control = false;
-	for (const std::u8string& source_comment : comments) {
-		if (!has_control) { // Don’t bother analyzing comments if the flag is already up.
-			for (unsigned char c : source_comment) {
-				if (c < 0x20 && c != '\n') {
-					has_control = true;
-					break;
-				}
-			}
-		}
-		std::u8string utf8_comment = format_value(source_comment, opt);
-		puts_utf8(utf8_comment, output, opt);
+	for (std::u8string_view source_comment : comments) {
+		// Don’t bother analyzing comments if the flag is already up.
+		has_control = has_control || has_control_characters(source_comment);
+		print_comment(source_comment, output, opt);
 	}
 	if (has_control)
-		fputs("warning: Some tags contain control characters.\n", stderr);
+		warn_control_characters();
+}
+
+/**
+ * Return the length of the valid UTF-8 sequence at the beginning of data, or 0 if it is not valid.
+ * Overlong encodings, surrogates and code points above U+10FFFF are rejected, as per RFC 3629.
+ */
+static size_t utf8_sequence_length(std::string_view data)
+{
+	auto byte = [&](size_t i) { return static_cast<unsigned char>(data[i]); };
+	auto continuation = [&](size_t i) { return i < data.size() && (byte(i) & 0xC0) == 0x80; };
+	unsigned char lead = byte(0);
+	if (lead < 0x80)
+		return 1;
+	if (lead >= 0xC2 && lead <= 0xDF)
+		return continuation(1) ? 2 : 0;
+	if (lead >= 0xE0 && lead <= 0xEF) {
+		if (!continuation(1) || !continuation(2))
+			return 0;
+		if ((lead == 0xE0 && byte(1) < 0xA0) || (lead == 0xED && byte(1) > 0x9F))
+			return 0;
+		return 3;
+	}
+	if (lead >= 0xF0 && lead <= 0xF4) {
+		if (!continuation(1) || !continuation(2) || !continuation(3))
+			return 0;
+		if ((lead == 0xF0 && byte(1) < 0x90) || (lead == 0xF4 && byte(1) > 0x8F))
+			return 0;
+		return 4;
+	}
+	return 0;
+}
+
+/**
+ * Append data to out as a JSON string literal, escaping the invalid UTF-8 bytes as described in
+ * #ot::print_json.
+ */
+static void append_json_string(std::string& out, std::string_view data)
+{
+	static const char hex[] = "0123456789abcdef";
+	out.push_back('"');
+	while (!data.empty()) {
+		// Copy the longest run of characters that need no escaping at once.
+		size_t run = 0;
+		for (; run < data.size(); ++run) {
+			unsigned char c = data[run];
+			if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80)
+				break;
+		}
+		out.append(data.data(), run);
+		data.remove_prefix(run);
+		if (data.empty())
+			break;
+
+		unsigned char c = data[0];
+		size_t length = utf8_sequence_length(data);
+		if (length > 1) {
+			out.append(data.data(), length);
+		} else if (c == '"' || c == '\\') {
+			out.push_back('\\');
+			out.push_back(c);
+		} else if (c == '\n') {
+			out += "\\n";
+		} else if (c == '\t') {
+			out += "\\t";
+		} else if (c == '\r') {
+			out += "\\r";
+		} else if (c < 0x20) {
+			out += "\\u00";
+			out.push_back(hex[c >> 4]);
+			out.push_back(hex[c & 0xF]);
+		} else {
+			out += "\\udc";
+			out.push_back(hex[c >> 4]);
+			out.push_back(hex[c & 0xF]);
+		}
+		data.remove_prefix(length > 1 ? length : 1);
+	}
+	out.push_back('"');
+}
+
+static std::string_view as_chars(std::u8string_view s)
+{
+	return std::string_view(reinterpret_cast<const char*>(s.data()), s.size());
+}
+
+/**
+ * Start the JSON object of #ot::print_json, up to the opening of the comments array. The link
+ * field is only added when link is not 0.
+ */
+static std::string json_head(std::string_view path, unsigned link, std::u8string_view vendor)
+{
+	std::string json = "{\"path\":";
+	append_json_string(json, path);
+	if (link != 0)
+		json += ",\"link\":" + std::to_string(link);
+	json += ",\"vendor\":";
+	append_json_string(json, as_chars(vendor));
+	json += ",\"comments\":[";
+	return json;
+}
+
+/** Append the [name, value] pair of a comment of the comments array of #ot::print_json. */
+static void append_json_comment(std::string& json, std::u8string_view comment)
+{
+	std::string_view name = as_chars(comment);
+	size_t equal = name.find('=');
+	json.push_back('[');
+	append_json_string(json, name.substr(0, equal));
+	json.push_back(',');
+	if (equal == std::string_view::npos)
+		json += "null";
+	else
+		append_json_string(json, name.substr(equal + 1));
+	json.push_back(']');
+}
+
+/**
+ * Close the comments array and the JSON object of #ot::print_json. Only the covers of the tags are
+ * looked at, so they may contain only the cover comments.
+ */
+static void append_json_tail(std::string& json, size_t extra_data_size, off_t bytes_read, const ot::opus_tags& tags)
+{
+	json += "],\"extra_data\":" + std::to_string(extra_data_size);
+	json += ",\"bytes_read\":" + std::to_string(bytes_read);
+	json += ",\"cover\":";
+	std::optional<ot::cover_view> cover;
+	try {
+		cover = find_cover(tags);
+	} catch (const ot::status& rc) {
+		fprintf(ot::thread_stderr, "warning: Invalid cover art: %s\n", rc.message.c_str());
+	}
+	if (cover) {
+		json += "{\"mime_type\":";
+		append_json_string(json, cover->mime_type);
+		json += ",\"size\":" + std::to_string(cover->picture_size) + "}";
+	} else {
+		json += "null";
+	}
+	json += "}\n";
+}
+
+/** Write the whole string to the output, or throw. */
+static void write_string(std::string_view data, FILE* output)
+{
+	if (fwrite(data.data(), 1, data.size(), output) < data.size())
+		throw ot::status {ot::st::standard_error, "fwrite error: "s + strerror(errno)};
+}
+
+void ot::print_json(std::string_view path, const ot::opus_tags& tags, off_t bytes_read, FILE* output)
+{
+	std::string json = json_head(path, 0, tags.vendor);
+	bool first = true;
+	for (std::u8string_view comment : tags.comments) {
+		if (!first)
+			json.push_back(',');
+		first = false;
+		append_json_comment(json, comment);
+	}
+	append_json_tail(json, tags.extra_data.size(), bytes_read, tags);
+	write_string(json, output);
 }
 
 std::list<std::u8string> ot::read_comments(FILE* input, const ot::options& opt)
@@ -355,28 +679,16 @@ std::list<std::u8string> ot::read_comments(FILE* input, const ot::options& opt)
 	return comments;
 }
 
+void ot::delete_comments(comment_list& comments, const std::u8string& selector)
+{
+	comment_selector predicate(selector);
+	comments.remove_if([&](std::u8string_view comment) { return predicate.matches(comment); });
+}
+
 void ot::delete_comments(std::list<std::u8string>& comments, const std::u8string& selector)
 {
-	auto name = selector.data();
-	auto equal = selector.find(u8'=');
-	auto value = (equal == std::u8string::npos ? nullptr : name + equal + 1);
-	auto name_len = value ? equal : selector.size();
-	auto value_len = value ? selector.size() - equal - 1 : 0;
-	auto it = comments.begin(), end = comments.end();
-	while (it != end) {
-		auto current = it++;
-		/** \todo Avoid using strncasecmp because it assumes the system locale is UTF-8. */
-		bool name_match = current->size() > name_len + 1 &&
-		                  (*current)[name_len] == '=' &&
-		                  strncasecmp((const char*) current->data(), (const char*) name, name_len) == 0;
-		if (!name_match)
-			continue;
-		bool value_match = value == nullptr ||
-		                   (current->size() == selector.size() &&
-		                    memcmp(current->data() + equal + 1, value, value_len) == 0);
-		if (value_match)
-			comments.erase(current);
-	}
+	comment_selector predicate(selector);
+	comments.remove_if([&](const std::u8string& comment) { return predicate.matches(comment); });
 }
 
 /** Apply the modifications requested by the user to the opustags packet. */
@@ -392,7 +704,9 @@ static void edit_tags(ot::opus_tags& tags, const ot::options& opt)
 	}
 
 	for (const std::u8string& comment : opt.to_add)
-		tags.comments.emplace_back(comment);
+		tags.comments.push_back(comment);
+	if (opt.cover_to_add)
+		tags.comments.push_back(*opt.cover_to_add);
 }
 
 /** Spawn VISUAL or EDITOR to edit the given tags. */
@@ -431,13 +745,13 @@ static void edit_tags_interactively(ot::opus_tags& tags, const std::optional<std
 	bool modified = (before.tv_sec != after.tv_sec || before.tv_nsec != after.tv_nsec);
 	if (editor_rc != ot::st::ok) {
 		if (modified)
-			fprintf(stderr, "warning: Leaving %s on the disk.\n", tags_path.c_str());
+			fprintf(ot::thread_stderr, "warning: Leaving %s on the disk.\n", tags_path.c_str());
 		else
 			remove(tags_path.c_str());
 		throw editor_rc;
 	} else if (!modified) {
 		remove(tags_path.c_str());
-		fputs("Cancelling edition because the tags file was not modified.\n", stderr);
+		fputs("Cancelling edition because the tags file was not modified.\n", ot::thread_stderr);
 		throw ot::status {ot::st::cancel};
 	}
 
@@ -448,7 +762,7 @@ static void edit_tags_interactively(ot::opus_tags& tags, const std::optional<std
 	try {
 		tags.comments = ot::read_comments(tags_file.get(), opt);
 	} catch (const ot::status& rc) {
-		fprintf(stderr, "warning: Leaving %s on the disk.\n", tags_path.c_str());
+		fprintf(ot::thread_stderr, "warning: Leaving %s on the disk.\n", tags_path.c_str());
 		throw;
 	}
 	tags_file.reset();
@@ -459,18 +773,21 @@ static void edit_tags_interactively(ot::opus_tags& tags, const std::optional<std
 	remove(tags_path.c_str());
 }
 
+/**
+ * Write the cover to the file specified by --output-cover. The picture is decoded and written by
+ * chunks, so that the memory used does not depend on its size.
+ */
 static void output_cover(const ot::opus_tags& tags, const ot::options &opt)
 {
-	std::optional<ot::picture> cover = extract_cover(tags);
+	std::optional<ot::cover_view> cover = find_cover(tags);
 	if (!cover) {
-		fputs("warning: No cover found.\n", stderr);
+		fputs("warning: No cover found.\n", ot::thread_stderr);
 		return;
 	}
 
-	ot::file output;
-	if (opt.cover_out == "-") {
-		output = stdout;
-	} else {
+	FILE* output = ot::thread_stdout;
+	ot::file owned_output;
+	if (opt.cover_out != "-") {
 		struct stat output_info;
 		if (stat(opt.cover_out->c_str(), &output_info) == 0) {
 			if (S_ISREG(output_info.st_mode) && !opt.overwrite)
@@ -479,28 +796,495 @@ static void output_cover(const ot::opus_tags& tags, const ot::options &opt)
 			throw ot::status {ot::st::error, "Could not identify '" + opt.cover_out.value() + "': " + strerror(errno)};
 		}
 
-		output = fopen(opt.cover_out->c_str(), "w");
+		owned_output = output = fopen(opt.cover_out->c_str(), "w");
 		if (output == nullptr)
 			throw ot::status {ot::st::standard_error, "Could not open '" + opt.cover_out.value() + "' for writing: " + strerror(errno)};
 	}
 
-	if (fwrite(cover->picture_data.data(), 1, cover->picture_data.size(), output.get()) < cover->picture_data.size())
+	cover->read_picture([&](ot::byte_string_view chunk) {
+		if (fwrite(chunk.data(), 1, chunk.size(), output) < chunk.size())
+			throw ot::status {ot::st::standard_error, "fwrite error: "s + strerror(errno)};
+	});
+}
+
+/**
+ * Print the tags of the file at path in read-only mode, or just the vendor with --vendor. The
+ * comments are fed one at a time and printed right away, so that comment headers of any size can be
+ * listed while they are parsed, without being held in memory.
+ *
+ * The edition options are applied on the fly, with the same effect as #edit_tags: the deleted
+ * comments are skipped, and the added ones are listed last. Only the covers are kept until the end,
+ * for --output-cover, which extracts the cover of the original tags, and for the JSON output.
+ *
+ * With --with-filename, every line is prefixed with the path and a colon, like grep -H does,
+ * including the continuation lines of multi-line tags.
+ *
+ * With --link, the JSON object tells which link the tags come from. With --link all, the plain
+ * listing of every link starts with a "# link N" line, which #ot::read_comments ignores.
+ *
+ * The JSON object is an exception: it is built in memory and only written by #finish, so that an
+ * invalid packet leaves no incomplete record in the output. The plain listing, on the contrary,
+ * may already have printed some comments when the error is found.
+ */
+class tags_lister {
+public:
+	/**
+	 * The vendor of the tags must be set before the first comment is fed, and is only read
+	 * then. link is the index of the link of the tags, or 0 when the file is not read link by
+	 * link. The cover is only extracted when with_cover is true.
+	 */
+	tags_lister(const std::string& path, const ot::opus_tags& tags, const ot::options& opt,
+	            unsigned link, bool with_cover);
+	~tags_lister();
+	/** List a comment of the original tags, unless it is deleted. */
+	void comment(std::u8string_view comment);
+	/**
+	 * List the added comments, extract the cover, and complete the output. bytes_read is the
+	 * amount of the file read so far, reported in the JSON output.
+	 */
+	void finish(size_t extra_data_size, off_t bytes_read);
+private:
+	void list(std::u8string_view comment);
+	void start();
+	void flush_lines();
+	const std::string& path;
+	const ot::opus_tags& tags;
+	const ot::options& opt;
+	unsigned link;
+	bool with_cover;
+	/** The comments are not printed at all with --output-cover -. */
+	bool quiet;
+	std::vector<ot::comment_selector> deleted;
+	/** The covers of the original tags, for --output-cover. */
+	ot::opus_tags covers;
+	/** The covers listed, for the JSON output. */
+	ot::opus_tags listed_covers;
+	bool started = false;
+	bool has_control = false;
+	/** The JSON object, written once complete. */
+	std::string json;
+	FILE* output;
+	/** Buffer of the lines to prefix with --with-filename. */
+	ot::file lines;
+	char* lines_data = nullptr;
+	size_t lines_size = 0;
+};
+
+static bool is_cover(std::u8string_view comment)
+{
+	return comment.starts_with(u8"METADATA_BLOCK_PICTURE=");
+}
+
+tags_lister::tags_lister(const std::string& path, const ot::opus_tags& tags, const ot::options& opt,
+                         unsigned link, bool with_cover)
+	: path(path), tags(tags), opt(opt), link(link), with_cover(with_cover), quiet(opt.cover_out == "-"),
+	  output(ot::thread_stdout)
+{
+	if (!opt.delete_all) {
+		for (const std::u8string& selector : opt.to_delete)
+			deleted.emplace_back(selector);
+	}
+	if (opt.with_filename) {
+		if ((lines = open_memstream(&lines_data, &lines_size)) == nullptr)
+			throw std::bad_alloc();
+		output = lines.get();
+	}
+}
+
+tags_lister::~tags_lister()
+{
+	lines.reset();
+	free(lines_data);
+}
+
+void tags_lister::comment(std::u8string_view comment)
+{
+	if (opt.cover_out && with_cover && is_cover(comment))
+		covers.comments.push_back(comment);
+	if (opt.delete_all)
+		return;
+	for (const ot::comment_selector& selector : deleted) {
+		if (selector.matches(comment))
+			return;
+	}
+	list(comment);
+}
+
+/** Print the beginning of the output, now that the vendor is known. */
+void tags_lister::start()
+{
+	started = true;
+	if (quiet)
+		return;
+	if (opt.json) {
+		json = json_head(path, link, opt.set_vendor.value_or(tags.vendor));
+		return;
+	}
+	if (opt.link == 0u)
+		fprintf(output, "# link %u%c", link, opt.tag_delimiter);
+	if (opt.print_vendor)
+		puts_utf8(opt.set_vendor.value_or(tags.vendor), output, opt);
+	flush_lines();
+}
+
+void tags_lister::list(std::u8string_view comment)
+{
+	bool first = !started;
+	if (first)
+		start();
+	if (quiet) {
+		return;
+	} else if (opt.json) {
+		if (is_cover(comment))
+			listed_covers.comments.push_back(comment);
+		if (!first)
+			json.push_back(',');
+		append_json_comment(json, comment);
+	} else if (!opt.print_vendor) {
+		has_control = has_control || has_control_characters(comment);
+		print_comment(comment, output, opt);
+		flush_lines();
+	}
+}
+
+void tags_lister::finish(size_t extra_data_size, off_t bytes_read)
+{
+	if (!quiet && !opt.print_vendor) {
+		ot::comment_list added = opt.to_add;
+		if (opt.cover_to_add)
+			added.push_back(*opt.cover_to_add);
+		for (std::u8string_view comment : added)
+			list(comment);
+	}
+	if (!started)
+		start();
+	if (opt.cover_out && with_cover)
+		output_cover(covers, opt);
+	if (quiet)
+		return;
+	if (opt.json) {
+		append_json_tail(json, extra_data_size, bytes_read, listed_covers);
+		write_string(json, ot::thread_stdout);
+	} else if (has_control) {
+		warn_control_characters();
+	}
+}
+
+/** With --with-filename, print the lines buffered so far with their prefix. */
+void tags_lister::flush_lines()
+{
+	if (lines == nullptr)
+		return;
+	if (fflush(lines.get()) != 0)
+		throw std::bad_alloc();
+	std::string_view remaining(lines_data, lines_size);
+	std::string prefixed;
+	while (!remaining.empty()) {
+		size_t end = remaining.find(opt.tag_delimiter);
+		end = end == std::string_view::npos ? remaining.size() : end + 1;
+		prefixed += path;
+		prefixed += ':';
+		prefixed += remaining.substr(0, end);
+		remaining.remove_prefix(end);
+	}
+	write_string(prefixed, ot::thread_stdout);
+	rewind(lines.get());
+}
+
+/**
+ * With --match, print the path of the file if its OpusTags packet matches the selectors. The
+ * packet is tested as is, without being parsed into an #ot::opus_tags.
+ */
+static void print_if_matching(const std::string& path, ot::byte_string_view packet, const ot::options& opt)
+{
+	if (!ot::match_tags(packet, opt.matches))
+		return;
+	std::string line = path + opt.tag_delimiter;
+	if (fwrite(line.data(), 1, line.size(), ot::thread_stdout) < line.size())
 		throw ot::status {ot::st::standard_error, "fwrite error: "s + strerror(errno)};
 }
 
+/**
+ * List the tags of an OpusTags packet in read-only mode. The packet is parsed lazily, so that the
+ * comments are neither copied nor even read unless they are printed. The cover is only extracted
+ * when with_cover is true. bytes_read is the amount of the file read to get the packet, 0 if it
+ * came from the catalog. link is passed to #tags_lister.
+ */
+static void list_tags(const std::string& path, ot::byte_string_view packet, const ot::options& opt,
+                      off_t bytes_read, unsigned link = 0, bool with_cover = true)
+{
+	if (!opt.matches.empty())
+		return print_if_matching(path, packet, opt);
+	ot::opus_tags tags = ot::parse_tags_view(packet);
+	tags_lister lister(path, tags, opt, link, with_cover);
+	for (std::u8string_view comment : tags.comments)
+		lister.comment(comment);
+	lister.finish(tags.extra_data.size(), bytes_read);
+}
+
+/**
+ * List the tags of the OpusTags packet starting on the current page of the reader, like
+ * #list_tags, but while the pages of the packet are read. The packet is never assembled, and the
+ * comments are printed as soon as they are parsed.
+ */
+static void stream_tags(ot::ogg_reader& reader, const ot::options& opt, unsigned link, bool with_cover)
+{
+	ot::opus_tags tags;
+	tags_lister lister(reader.path, tags, opt, link, with_cover);
+	ot::opus_tags_parser parser(tags, [&](std::u8string_view comment) { lister.comment(comment); });
+	reader.process_header_pages([&](ot::byte_string_view piece) { parser.feed(piece); });
+	parser.finish();
+	lister.finish(tags.extra_data.size(), reader.bytes_read);
+}
+
+/**
+ * Apply --padding: reset the padding to the reserved size, whether the packet already had padding
+ * or not. The edits made later without --padding then absorb their size changes into it. Extra data
+ * that must be preserved is never touched.
+ */
+static void reserve_padding(ot::opus_tags& tags, size_t reserved)
+{
+	if (!tags.extra_data.empty() && (tags.extra_data[0] & 1) != 0)
+		return;
+	tags.extra_data.assign(reserved, '\0');
+}
+
+/**
+ * Location of the OpusTags packet in the input stream, spanning one or more pages.
+ */
+struct header_span {
+	off_t offset; /**< Byte offset of the first page of the packet. */
+	off_t size; /**< Total size in bytes of the pages, headers included. */
+	long pages; /**< Number of pages. */
+	long first_pageno; /**< Page number of the first page. */
+	size_t packet_size; /**< Size of the OpusTags packet. */
+};
+
+/**
+ * Render the OpusTags packet for the given tags, if its pages can replace the old pages without
+ * moving any other page: the new pages must take exactly as many bytes and pages as the old ones,
+ * so that no page needs to be renumbered either. When resize is true, the padding at the end of the
+ * OpusTags packet is resized to absorb the size difference, if any.
+ *
+ * The layout of the pages is checked before anything is rendered. Return the packet, or nothing if
+ * its pages do not fit. The tags are left untouched.
+ */
+static std::optional<ot::dynamic_ogg_packet> render_fitting_header(const header_span& span, ot::opus_tags& tags, bool resize)
+{
+	ot::byte_string original_extra_data = tags.extra_data;
+	if (resize)
+		ot::resize_padding(tags, span.packet_size);
+	std::optional<ot::dynamic_ogg_packet> packet;
+	ot::header_pages layout = ot::header_pages_layout(span.packet_size);
+	if (ot::rendered_size(tags) == span.packet_size && layout.count == span.pages &&
+	    static_cast<off_t>(layout.size) == span.size)
+		packet = ot::render_tags(tags);
+	tags.extra_data = std::move(original_extra_data);
+	return packet;
+}
+
+/** Write the pages of the OpusTags packet to the file descriptor, where the old ones were. */
+static void write_header_pages_at(int fd, int serialno, const header_span& span, const ogg_packet& packet)
+{
+	off_t offset = span.offset;
+	ot::paginate_header_packet(serialno, span.first_pageno, packet, [&](const ogg_page& page) {
+		ot::write_at(fd, ot::byte_string_view(reinterpret_cast<char*>(page.header), page.header_len), offset);
+		ot::write_at(fd, ot::byte_string_view(reinterpret_cast<char*>(page.body), page.body_len),
+		             offset + page.header_len);
+		offset += page.header_len + page.body_len;
+	});
+}
+
+/**
+ * Overwrite the comment header pages of the file at path with the pages of the packet rendered by
+ * #render_fitting_header, leaving all the other pages untouched.
+ *
+ * Return false if the file is not a regular file, in which case it is left untouched.
+ */
+static bool patch_in_place(const std::string& path, int serialno, const header_span& span, const ogg_packet& packet)
+{
+	// O_NONBLOCK prevents us from hanging on FIFOs, and has no effect on regular files.
+	int fd = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		throw ot::status {ot::st::standard_error,
+		                  "Could not open '" + path + "' for writing: " + strerror(errno)};
+	struct stat file_info;
+	bool regular = fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode);
+	try {
+		if (regular)
+			write_header_pages_at(fd, serialno, span, packet);
+	} catch (const ot::status&) {
+		close(fd);
+		throw;
+	}
+	if (close(fd) == -1)
+		throw ot::status {ot::st::standard_error, "Could not close '" + path + "': " + strerror(errno)};
+	return regular;
+}
+
+/** Return the file descriptor of the given file if it is a regular file, or -1 otherwise. */
+static int regular_file_descriptor(FILE* file)
+{
+	int fd = fileno(file);
+	struct stat file_info;
+	if (fd == -1 || fstat(fd, &file_info) == -1 || !S_ISREG(file_info.st_mode))
+		return -1;
+	return fd;
+}
+
+/**
+ * Find the serial number of the last page of the input file with #ot::last_page_serialno. Only the
+ * end of the file is read, either from the mapping or with a single pread.
+ *
+ * Return nothing when the input is not a regular file, or when it does not end with a valid page.
+ */
+static std::optional<int> last_input_serialno(ot::ogg_reader& reader)
+{
+	ot::byte_string_view data = reader.mapping.data();
+	ot::byte_string tail;
+	if (data.empty()) {
+		int fd = regular_file_descriptor(reader.file);
+		struct stat info;
+		if (fd == -1 || fstat(fd, &info) == -1)
+			return {};
+		off_t offset = std::max<off_t>(0, info.st_size - ot::max_page_size);
+		tail.resize(info.st_size - offset);
+		ssize_t len;
+		do {
+			len = pread(fd, tail.data(), tail.size(), offset);
+		} while (len == -1 && errno == EINTR);
+		if (len != static_cast<ssize_t>(tail.size()))
+			return {};
+		data = tail;
+	}
+	data = data.substr(data.size() - std::min(data.size(), ot::max_page_size));
+	return ot::last_page_serialno(data);
+}
+
+/**
+ * Tell whether the last page of the input file belongs to the given stream, in which case no other
+ * link of a chained stream follows it.
+ *
+ * Return false when the input is not a regular file, or when we can’t tell.
+ */
+static bool is_last_stream(ot::ogg_reader& reader, int serialno)
+{
+	return last_input_serialno(reader) == serialno;
+}
+
+/**
+ * Check the pages of the input from the specified offset to its end, before they are kept without
+ * going through the reader. The capture pattern and the lengths of every page are followed, so that
+ * missing or garbage data is reported with the same errors as the reader would, but only the CRC of
+ * the last page is checked, since checking them all would cost as much as reading the pages. The
+ * pages are read from the mapping of the input, which the kernel reads ahead sequentially.
+ *
+ * Return false if the input is not mapped, in which case its pages must be read with the reader.
+ */
+static bool check_remaining_pages(ot::ogg_reader& reader, off_t offset)
+{
+	ot::byte_string_view data = reader.mapping.data();
+	if (data.empty() || static_cast<size_t>(offset) > data.size())
+		return false;
+	data.remove_prefix(offset);
+	while (!data.empty()) {
+		ogg_page page;
+		ot::page_check check = ot::parse_page(data, page, false);
+		if (check == ot::page_check::truncated_header || check == ot::page_check::truncated_page)
+			throw ot::status {ot::st::bad_stream, "Unsynced data at end of stream."};
+		size_t size = page.header_len + page.body_len;
+		if (check != ot::page_check::valid || (size == data.size() && !ot::check_page_checksum(page)))
+			throw ot::status {ot::st::bad_stream, "Unsynced data in stream."};
+		data.remove_prefix(size);
+	}
+	return true;
+}
+
+/**
+ * Make the output a clone of the input with the comment header pages replaced by the ones of the
+ * packet rendered by #render_fitting_header. On copy-on-write file systems like Btrfs or XFS, the
+ * clone shares the data blocks of the input, so that only the blocks of the header actually get
+ * written.
+ *
+ * Since the clone replaces the whole output, the output must contain nothing but the pages that
+ * preceded the header, written unchanged by the writer, and its file position must be at their end.
+ * This rules out outputs that already had data, like standard output appended to a file. Like
+ * for #copy_remaining_pages, the pages after the header are checked by #check_remaining_pages.
+ *
+ * Return false if the files could not be cloned, in which case the output is left untouched and
+ * the pages must be written normally.
+ */
+static bool clone_and_patch(ot::ogg_reader& reader, ot::ogg_writer& writer, int serialno, const header_span& span, const ogg_packet& packet)
+{
+	int input = regular_file_descriptor(reader.file);
+	int output = regular_file_descriptor(writer.file);
+	if (input == -1 || output == -1 || !check_remaining_pages(reader, span.offset + span.size))
+		return false;
+	writer.flush();
+	struct stat output_info;
+	if (fstat(output, &output_info) == -1 || output_info.st_size != span.offset ||
+	    lseek(output, 0, SEEK_CUR) != span.offset)
+		return false;
+	if (!ot::clone_file(input, output))
+		return false;
+	write_header_pages_at(output, serialno, span, packet);
+	if (fseeko(writer.file, 0, SEEK_END) != 0)
+		throw ot::status {ot::st::standard_error, "fseek error: "s + strerror(errno)};
+	return true;
+}
+
+/**
+ * Forward all the pages from the specified input offset to the output as a raw byte copy, without
+ * going through the reader. This is only correct when the pages need not be renumbered. Copying the
+ * file directly lets the kernel perform the copy without going through user space, let alone libogg.
+ *
+ * The pages are first checked by #check_remaining_pages, which catches truncated files and garbage
+ * between pages like the reader, but not damaged page contents, since only the last CRC is checked.
+ *
+ * Return false if the input is not a mapped regular file, in which case the pages must be forwarded
+ * one by one with the reader.
+ */
+static bool copy_remaining_pages(ot::ogg_reader& reader, ot::ogg_writer& writer, off_t offset)
+{
+	int input = regular_file_descriptor(reader.file);
+	int output = fileno(writer.file);
+	if (input == -1 || output == -1 || !check_remaining_pages(reader, offset))
+		return false;
+	writer.flush();
+	ot::copy_file_tail(input, offset, output);
+	return true;
+}
+
+
 /**
  * Main loop of opustags. Read the packets from the reader, and forwards them to the writer.
  * Transform the OpusTags packet on the fly.
  *
  * The writer is optional. When writer is nullptr, opustags runs in read-only mode.
+ *
+ * When the new comment header fits exactly in place of the old one, the rest of the stream is not
+ * even read. With --in-place, the input file is patched directly, in which case the output of the
+ * writer is incomplete and must be discarded, which is signaled by returning false. Otherwise, the
+ * input is cloned into the output when the file system supports it, and the header patched.
+ *
+ * When tags_packet is not null, it receives a copy of the original OpusTags packet.
  */
-static void process(ot::ogg_reader& reader, ot::ogg_writer* writer, const ot::options &opt)
+static bool process(ot::ogg_reader& reader, ot::ogg_writer* writer, const ot::options &opt,
+                    ot::byte_string* tags_packet = nullptr)
 {
-	bool focused = false; /*< the stream on which we operate is defined */
-	int focused_serialno; /*< when focused, the serialno of the focused stream */
+	/** The pages of the other multiplexed streams, like video or Skeleton tracks, are forwarded
+	 *  untouched. We operate on the first Opus stream of every link of the chain, whose
+	 *  identification header is among the beginning of stream pages of the link. */
+	std::optional<int> focused_serialno;
+	bool focused_ended = false; /*< the end of the focused stream was reached */
+	long focused_pages = 0; /*< number of pages of the focused stream read so far */
+	unsigned link = 0; /*< index of the current link in the chain, starting from 1 */
+	bool selected = false; /*< the current link is to be listed or edited */
+	bool all_links = opt.link == 0u;
+	bool edited_earlier_link = false; /*< the writer holds an edited header of a previous link */
 
 	/** When the number of pages the OpusTags packet takes differs from the input stream to the
-	 *  output stream, we need to renumber all the succeeding pages. If the input stream
+	 *  output stream, we need to renumber all the succeeding pages of the stream. If the input stream
 	 *  contains gaps, the offset will naively reproduce the gaps: page numbers 0 (1) 2 4 will
 	 *  become 0 (1 2) 3 5, where (…) is the OpusTags packet, and not 0 (1 2) 3 4. */
 	long pageno_offset = 0;
@@ -508,52 +1292,177 @@ static void process(ot::ogg_reader& reader, ot::ogg_writer* writer, const ot::op
 	while (reader.next_page()) {
 		auto serialno = ogg_page_serialno(&reader.page);
 		auto pageno = ogg_page_pageno(&reader.page);
-		if (!focused) {
-			focused = true;
+		if (!focused_serialno && !ogg_page_bos(&reader.page))
+			throw ot::status {ot::st::error, "Not an Opus stream."};
+		if ((!focused_serialno || focused_ended) && ogg_page_bos(&reader.page) &&
+		    ot::is_opus_stream(reader.page)) {
+			// Beginning of a new link.
+			if (focused_serialno && focused_pages < 2)
+				throw ot::status {ot::st::error, "Expected at least 2 Ogg pages."};
 			focused_serialno = serialno;
-		} else if (serialno != focused_serialno) {
-			/** \todo Support mixed streams. */
-			throw ot::status {ot::st::error, "Muxed streams are not supported yet."};
+			focused_ended = false;
+			focused_pages = 0;
+			pageno_offset = 0;
+			++link;
+			selected = all_links || link == opt.link.value_or(1);
 		}
-		if (reader.absolute_page_no == 0) { // Identification header
-			if (!ot::is_opus_stream(reader.page))
-				throw ot::status {ot::st::error, "Not an Opus stream."};
+		if (serialno != focused_serialno) {
 			if (writer)
 				writer->write_page(reader.page);
-		} else if (reader.absolute_page_no == 1) { // Comment header
+			continue;
+		}
+		++focused_pages;
+		if (focused_pages == 2 && selected && !writer) { // Comment header, listed in place
+			// With several links, only the first cover is extracted.
+			bool with_cover = link == 1 || !all_links;
+			unsigned listed_link = opt.link ? link : 0;
+			// The whole packet is only needed to be cached, or for --match.
+			if (tags_packet || !opt.matches.empty()) {
+				reader.process_header_packet([&](ogg_packet& p) {
+					ot::byte_string_view packet(reinterpret_cast<const char*>(p.packet), p.bytes);
+					if (tags_packet)
+						tags_packet->assign(packet);
+					list_tags(reader.path, packet, opt, reader.bytes_read, listed_link, with_cover);
+				});
+			} else {
+				stream_tags(reader, opt, listed_link, with_cover);
+			}
+			if (!all_links)
+				break;
+		} else if (focused_pages == 2 && selected) { // Comment header
+			header_span span;
+			span.offset = reader.page_offset;
+			span.first_pageno = pageno;
 			ot::opus_tags tags;
-			reader.process_header_packet([&tags](ogg_packet& p) { tags = ot::parse_tags(p); });
-			if (opt.cover_out)
+			bool interleaved = false; /*< pages of other streams come between the header pages */
+			// The comments are parsed as the pages are read, without assembling the packet.
+			// They are all kept to be rendered again though, so editing still needs about
+			// twice the size of the packet: one copy in the tags and one in the new packet.
+			ot::opus_tags_parser parser(tags);
+			reader.process_header_pages([&](ot::byte_string_view piece) {
+				parser.feed(piece);
+			}, [&](const ogg_page& foreign) {
+				// Forward them right away rather than buffering them.
+				interleaved = true;
+				writer->write_page(foreign);
+			});
+			parser.finish();
+			span.packet_size = parser.size();
+			// With several links, only the first cover is extracted.
+			if (opt.cover_out && (link == 1 || !all_links))
 				output_cover(tags, opt);
 			edit_tags(tags, opt);
-			if (writer) {
-				if (opt.edit_interactively) {
-					fflush(writer->file); // flush before calling the subprocess
-					edit_tags_interactively(tags, writer->path, opt);
-				}
-				auto packet = ot::render_tags(tags);
-				writer->write_header_packet(serialno, pageno, packet);
-				pageno_offset = writer->next_page_no - 1 - reader.absolute_page_no;
-			} else {
-				if (opt.cover_out != "-") {
-					if (opt.print_vendor)
-						puts_utf8(tags.vendor, stdout, opt);
-					else
-						ot::print_comments(tags.comments, stdout, opt);
-				}
-				break;
+			span.size = reader.page_offset + reader.page.header_len + reader.page.body_len - span.offset;
+			long last_pageno = ogg_page_pageno(&reader.page);
+			span.pages = last_pageno - pageno + 1;
+			if (opt.edit_interactively) {
+				writer->flush(); // flush before calling the subprocess
+				edit_tags_interactively(tags, writer->path, opt);
+			}
+			if (opt.padding)
+				reserve_padding(tags, *opt.padding);
+			// The rest of the file can be left as is when no other link is to be edited.
+			bool last_edit = !all_links || is_last_stream(reader, serialno);
+			// With --padding, reserve_padding already decided the padding size. The
+			// header cannot be patched when its pages are mixed with foreign ones, nor
+			// when the edits of the previous links are only in the output.
+			std::optional<ot::dynamic_ogg_packet> fitting;
+			if (!interleaved)
+				fitting = render_fitting_header(span, tags, !opt.padding);
+			// Like when copying them, the pages left untouched must be checked before
+			// patching, or a truncated file would be edited without an error.
+			if (fitting && last_edit && !edited_earlier_link) {
+				if (opt.in_place && check_remaining_pages(reader, span.offset + span.size) &&
+				    patch_in_place(*writer->path, serialno, span, *fitting))
+					return false;
+				if (clone_and_patch(reader, *writer, serialno, span, *fitting))
+					return true;
 			}
+			auto packet = fitting ? std::move(*fitting) : ot::render_tags(tags);
+			writer->write_header_packet(serialno, pageno, packet);
+			edited_earlier_link = true;
+			pageno_offset = writer->next_page_no[serialno] - 1 - last_pageno;
+			if (last_edit && pageno_offset == 0 &&
+			    copy_remaining_pages(reader, *writer, span.offset + span.size))
+				return true;
 		} else if (writer) {
 			ot::renumber_page(reader.page, pageno + pageno_offset);
 			writer->write_page(reader.page);
 		}
+		if (ogg_page_eos(&reader.page))
+			focused_ended = true;
 	}
-	if (reader.absolute_page_no < 1)
+	if (!focused_serialno)
+		throw ot::status {ot::st::error, "Not an Opus stream."};
+	if (focused_pages < 2)
 		throw ot::status {ot::st::error, "Expected at least 2 Ogg pages."};
+	if (opt.link.value_or(0) > link)
+		throw ot::status {ot::st::error, "Link " + std::to_string(*opt.link) + " not found, the file has " +
+		                  std::to_string(link) + (link == 1 ? " link." : " links.")};
+	return true;
 }
 
-static void run_single(const ot::options& opt, const std::string& path_in, const std::optional<std::string>& path_out)
+/**
+ * Tell whether listing the tags needs the whole cover arts, in which case the catalog entries with
+ * summarized covers are of no use. Only --vendor, and --match unless it compares the value of the
+ * covers, can do without them, as well as the listings that delete the covers.
+ */
+static bool needs_covers(const ot::options& opt)
 {
+	static const std::u8string cover = u8"METADATA_BLOCK_PICTURE=";
+	if (opt.cover_out)
+		return true;
+	if (!opt.matches.empty()) {
+		return std::any_of(opt.matches.begin(), opt.matches.end(), [](const ot::comment_selector& s) {
+			return s.value && s.matches(cover + *s.value);
+		});
+	}
+	if (opt.print_vendor || opt.delete_all)
+		return false;
+	return std::none_of(opt.to_delete.begin(), opt.to_delete.end(), [](const std::u8string& s) {
+		ot::comment_selector selector(s);
+		return !selector.value && selector.matches(cover + u8"x");
+	});
+}
+
+/**
+ * List the tags of the input file from the catalog, if its entry is up to date, in which case the
+ * file is not even opened.
+ *
+ * Return false if the file must be read.
+ */
+static bool list_from_catalog(const ot::options& opt, const std::string& path, const ot::catalog& catalog, const ot::catalog_key& key)
+{
+	std::optional<ot::byte_string> packet = catalog.find(key, needs_covers(opt));
+	if (!packet)
+		return false;
+	list_tags(path, *packet, opt, 0);
+	return true;
+}
+
+/**
+ * Check the integrity of the input file with --verify. Regular files are mapped, and the other
+ * files are read into memory first.
+ *
+ * The CPU is shared between the files processed concurrently with --jobs.
+ */
+static void verify_file(const ot::options& opt, const std::string& path_in)
+{
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency() / opt.jobs);
+	ot::file_contents contents(path_in.c_str());
+	ot::verify_stream(contents.data(), threads);
+}
+
+static void run_single(const ot::options& opt, const std::string& path_in, const std::optional<std::string>& path_out, ot::catalog* catalog)
+{
+	if (opt.verify)
+		return verify_file(opt, path_in);
+
+	std::optional<ot::catalog_key> catalog_key;
+	if (catalog && path_in != "-" && (catalog_key = ot::get_catalog_key(path_in.c_str())) &&
+	    list_from_catalog(opt, path_in, *catalog, *catalog_key))
+		return;
+
 	ot::file input;
 	if (path_in == "-")
 		input = stdin;
@@ -561,13 +1470,25 @@ static void run_single(const ot::options& opt, const std::string& path_in, const
 		throw ot::status {ot::st::standard_error,
 		                  "Could not open '" + path_in + "' for reading: " + strerror(errno)};
 	ot::ogg_reader reader(input.get());
+	reader.path = path_in;
 
-	/* Read-only mode. */
+	/* Read-only mode.
+	 *
+	 * Only the headers are read, so we disable the stdio buffering to read no more than what
+	 * the reader asks for. */
 	if (!path_out) {
-		process(reader, nullptr, opt);
+		setvbuf(input.get(), nullptr, _IONBF, 0);
+		ot::byte_string tags_packet;
+		process(reader, nullptr, opt, catalog_key ? &tags_packet : nullptr);
+		if (catalog_key)
+			catalog->store(*catalog_key, tags_packet);
 		return;
 	}
 
+	/* The whole file is going to be read, so map it when possible to save the copy into the
+	 * buffer of the reader. */
+	reader.map_input();
+
 	/* Read-write mode.
 	 *
 	 * The output pointer is set to one of:
@@ -617,14 +1538,258 @@ static void run_single(const ot::options& opt, const std::string& path_in, const
 
 	ot::ogg_writer writer(output);
 	writer.path = path_out;
-	process(reader, &writer, opt);
+	if (!process(reader, &writer, opt))
+		return; // The input file was patched in place, and the partial file gets deleted.
+	writer.flush();
 
 	// Close the input file and finalize the output. When --in-place is specified, some file
 	// systems like SMB require that the input is closed first.
 	input.reset();
+	reader.mapping.unmap();
 	temporary_output.commit();
 }
 
+/** Input file to process, either specified by the user or found by --recursive. */
+struct input_file {
+	std::string path;
+	/** True if the file was found in a directory, and should be skipped if it is not Opus. */
+	bool discovered;
+};
+
+/**
+ * Tell whether the file looks like an Ogg Opus file by reading its first bytes only, which lets
+ * --recursive skip the other files at the cost of a single small read.
+ *
+ * When the file cannot be read, return true and let #run_single report the error.
+ */
+static bool looks_like_opus(const std::string& path)
+{
+	// O_NONBLOCK prevents us from hanging on FIFOs, and has no effect on regular files.
+	int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return true;
+	// Enough for the identification header pages of a few multiplexed streams.
+	char head[512];
+	ssize_t len;
+	do {
+		len = pread(fd, head, sizeof(head), 0);
+	} while (len == -1 && errno == EINTR);
+	close(fd);
+	return len == -1 || ot::starts_as_opus_stream({head, static_cast<size_t>(len)});
+}
+
+/**
+ * Build the list of files to process from the input paths, expanding the directories when
+ * --recursive is specified. Errors are reported on stderr like #run_reported does, in which case
+ * succeeded is set to false.
+ */
+static std::vector<input_file> list_input_files(const ot::options& opt, bool& succeeded)
+{
+	std::vector<input_file> inputs;
+	for (const std::string& path : opt.paths_in) {
+		struct stat info;
+		if (!opt.recursive || stat(path.c_str(), &info) == -1 || !S_ISDIR(info.st_mode)) {
+			inputs.push_back({path, false});
+			continue;
+		}
+		try {
+			ot::walk_directory(path, opt.follow_symlinks, [&](const std::string& file_path) {
+				inputs.push_back({file_path, true});
+			});
+		} catch (const ot::status& rc) {
+			fprintf(stderr, "%s: error: %s\n", path.c_str(), rc.message.c_str());
+			succeeded = false;
+		}
+	}
+	return inputs;
+}
+
+/**
+ * Background thread prefetching the beginning of the upcoming input files in read-only mode, so that
+ * listing files that are not cached is bound by the disk throughput rather than by the latency of
+ * every file. It stays at most #window files ahead of the file being processed, as reported by
+ * #advance, so that the prefetched data is not evicted before it is used.
+ *
+ * The files that will be listed from the catalog are skipped, since they won’t even be opened.
+ */
+class prefetcher {
+public:
+	prefetcher(const std::vector<input_file>& inputs, const ot::catalog* catalog, bool with_covers)
+		: inputs(inputs), catalog(catalog), with_covers(with_covers), thread([this]() { work(); }) {}
+	~prefetcher()
+	{
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		moved.notify_one();
+	}
+	/** Signal that the input file at the given index is being processed. */
+	void advance(size_t index)
+	{
+		{
+			std::lock_guard lock(mutex);
+			position = std::max(position, index);
+		}
+		moved.notify_one();
+	}
+private:
+	void work()
+	{
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			{
+				std::unique_lock lock(mutex);
+				moved.wait(lock, [&]() { return stopping || i < position + window; });
+				if (stopping)
+					return;
+			}
+			const char* path = inputs[i].path.c_str();
+			if (inputs[i].path == "-")
+				continue;
+			if (catalog) {
+				std::optional<ot::catalog_key> key = ot::get_catalog_key(path);
+				if (key && catalog->contains(*key, with_covers))
+					continue;
+			}
+			ot::prefetch_file(path, length);
+		}
+	}
+	/** Number of files to prefetch ahead of the file being processed. */
+	static constexpr size_t window = 16;
+	/** Number of bytes to prefetch, enough for the headers in all but the largest covers. */
+	static constexpr off_t length = ot::ogg_reader::max_read_size;
+	const std::vector<input_file>& inputs;
+	const ot::catalog* catalog;
+	/** Whether the listing needs the whole covers, see #needs_covers. */
+	bool with_covers;
+	std::mutex mutex;
+	std::condition_variable moved;
+	size_t position = 0;
+	bool stopping = false;
+	/** Declared last so that the thread starts once everything else is initialized. */
+	std::jthread thread;
+};
+
+/**
+ * Run #run_single and report its errors on #ot::thread_stderr, prefixed by the input path.
+ *
+ * Return false if the file could not be processed.
+ */
+static bool run_reported(const ot::options& opt, const input_file& input, ot::catalog* catalog)
+{
+	if (input.discovered && !looks_like_opus(input.path))
+		return true;
+	try {
+		run_single(opt, input.path, opt.in_place ? input.path : opt.path_out, catalog);
+		return true;
+	} catch (const ot::status& rc) {
+		if (!rc.message.empty())
+			fprintf(ot::thread_stderr, "%s: error: %s\n", input.path.c_str(), rc.message.c_str());
+		return false;
+	}
+}
+
+/**
+ * Outcome of the processing of a file by a worker of #run_parallel.
+ */
+struct job_result {
+	bool done = false; /**< True once the worker is done with the file. */
+	bool succeeded = false; /**< Return value of #run_reported. */
+	std::string output; /**< What would have been printed to stdout. */
+	std::string errors; /**< What would have been printed to stderr. */
+	std::exception_ptr exception; /**< Unexpected exception, like std::bad_alloc. */
+};
+
+/** Call #run_reported with the thread streams redirected to the buffers of the result. */
+static void run_job(const ot::options& opt, const input_file& input, ot::catalog* catalog, job_result& result)
+{
+	char* output_data = nullptr;
+	char* errors_data = nullptr;
+	size_t output_size = 0;
+	size_t errors_size = 0;
+	{
+		ot::file output = open_memstream(&output_data, &output_size);
+		ot::file errors = open_memstream(&errors_data, &errors_size);
+		if (output == nullptr || errors == nullptr)
+			throw std::bad_alloc();
+		ot::thread_stdout = output.get();
+		ot::thread_stderr = errors.get();
+		try {
+			result.succeeded = run_reported(opt, input, catalog);
+		} catch (...) {
+			result.exception = std::current_exception();
+		}
+		ot::thread_stdout = stdout;
+		ot::thread_stderr = stderr;
+	}
+	std::unique_ptr<char, decltype(&free)> output_guard(output_data, &free);
+	std::unique_ptr<char, decltype(&free)> errors_guard(errors_data, &free);
+	result.output.assign(output_data, output_size);
+	result.errors.assign(errors_data, errors_size);
+}
+
+/**
+ * Process all the input files with opt.jobs worker threads.
+ *
+ * The workers pick the next unprocessed file whenever they are done with one, so that a large file
+ * only keeps its own worker busy. Meanwhile, the main thread prints the outputs of the files in the
+ * input order, as soon as all the previous files are done, so that the output is the same as a
+ * sequential run.
+ *
+ * Return false if any file could not be processed.
+ */
+static bool run_parallel(const ot::options& opt, const std::vector<input_file>& inputs, ot::catalog* catalog, prefetcher* prefetch)
+{
+	size_t count = inputs.size();
+	std::vector<job_result> results(count);
+	std::mutex results_mutex;
+	std::condition_variable job_done;
+	std::atomic<size_t> next_job = 0;
+
+	auto work = [&]() {
+		for (size_t i; (i = next_job++) < count;) {
+			if (prefetch)
+				prefetch->advance(i);
+			job_result result;
+			try {
+				run_job(opt, inputs[i], catalog, result);
+			} catch (...) {
+				result.exception = std::current_exception();
+			}
+			std::lock_guard lock(results_mutex);
+			results[i] = std::move(result);
+			results[i].done = true;
+			job_done.notify_one();
+		}
+	};
+	// Declared last so that the threads are joined before anything else is destroyed.
+	std::vector<std::jthread> workers;
+	for (size_t i = 0; i < std::min<size_t>(opt.jobs, count); ++i)
+		workers.emplace_back(work);
+
+	bool succeeded = true;
+	for (size_t i = 0; i < count; ++i) {
+		job_result result;
+		{
+			std::unique_lock lock(results_mutex);
+			job_done.wait(lock, [&]() { return results[i].done; });
+			result = std::move(results[i]);
+		}
+		fwrite(result.output.data(), 1, result.output.size(), stdout);
+		if (!result.errors.empty()) {
+			fflush(stdout);
+			fwrite(result.errors.data(), 1, result.errors.size(), stderr);
+		}
+		if (result.exception) {
+			// Let the other workers finish their current file, but not start any other.
+			next_job = count;
+			std::rethrow_exception(result.exception);
+		}
+		succeeded = succeeded && result.succeeded;
+	}
+	return succeeded;
+}
+
 void ot::run(const ot::options& opt)
 {
 	if (opt.print_help) {
@@ -632,16 +1797,36 @@ void ot::run(const ot::options& opt)
 		return;
 	}
 
-	ot::status global_rc = st::ok;
-	for (const auto& path_in : opt.paths_in) {
-		try {
-			run_single(opt, path_in, opt.in_place ? path_in : opt.path_out);
-		} catch (const ot::status& rc) {
-			global_rc = st::error;
-			if (!rc.message.empty())
-				fprintf(stderr, "%s: error: %s\n", path_in.c_str(), rc.message.c_str());
+	std::unique_ptr<ot::catalog> catalog;
+	if (opt.catalog_path) {
+		catalog = std::make_unique<ot::catalog>();
+		catalog->load(opt.catalog_path->c_str());
+	}
+
+	bool succeeded = true;
+	std::vector<input_file> inputs = list_input_files(opt, succeeded);
+	// Same check as parse_options, now that the directories are expanded.
+	if (opt.cover_out && inputs.size() > 1)
+		throw status {st::bad_arguments, "Cannot use --output-cover with multiple input files."};
+	std::optional<prefetcher> prefetch;
+	if (!opt.in_place && !opt.path_out && inputs.size() > 1)
+		prefetch.emplace(inputs, catalog.get(), needs_covers(opt));
+	prefetcher* prefetch_ptr = prefetch ? &*prefetch : nullptr;
+	if (opt.jobs > 1 && inputs.size() > 1) {
+		succeeded = run_parallel(opt, inputs, catalog.get(), prefetch_ptr) && succeeded;
+	} else {
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			if (prefetch)
+				prefetch->advance(i);
+			succeeded = run_reported(opt, inputs[i], catalog.get()) && succeeded;
 		}
 	}
-	if (global_rc != st::ok)
-		throw global_rc;
+	prefetch.reset();
+	if (catalog) {
+		if (opt.prune_catalog)
+			catalog->prune();
+		catalog->save(opt.catalog_path->c_str());
+	}
+	if (!succeeded)
+		throw status {st::error};
 }
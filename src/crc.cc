@@ -0,0 +1,228 @@
+/**
+ * \file src/crc.cc
+ * \ingroup ogg
+ *
+ * CRC-32 of Ogg pages, as defined by RFC 3533: polynomial 0x04C11DB7, processed most significant
+ * bit first, with an initial value of 0 and no final XOR.
+ *
+ * libogg only provides a byte-wise table implementation, which becomes the bottleneck when every
+ * audio page of a file needs renumbering. Two kernels are implemented here:
+ *
+ * - slice-by-16, which consumes 16 bytes per iteration with 16 lookup tables, and works anywhere;
+ * - on x86-64 CPUs supporting PCLMULQDQ, carry-less multiplications that fold 64 bytes per
+ *   iteration, following Intel’s white paper “Fast CRC Computation for Generic Polynomials Using
+ *   PCLMULQDQ Instruction”.
+ *
+ * The kernel is chosen at runtime, once, according to the features of the CPU.
+ */
+
+#include <opustags.h>
+
+#include <string.h>
+#include <array>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define OT_CRC_CLMUL
+#  include <immintrin.h>
+#endif
+
+/** Ogg’s CRC polynomial, without its implicit x³² term. */
+static constexpr uint32_t polynomial = 0x04C11DB7;
+
+/**
+ * table[k][b] is the CRC of the byte b followed by k null bytes, so that the contribution of the
+ * i-th byte of a 16-byte block is table[15 - i][byte].
+ */
+static constexpr auto crc_tables = [] {
+	std::array<std::array<uint32_t, 256>, 16> table {};
+	for (uint32_t b = 0; b < 256; ++b) {
+		uint32_t crc = b << 24;
+		for (int i = 0; i < 8; ++i)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ polynomial : crc << 1;
+		table[0][b] = crc;
+	}
+	for (size_t k = 1; k < 16; ++k) {
+		for (size_t b = 0; b < 256; ++b) {
+			uint32_t previous = table[k - 1][b];
+			table[k][b] = (previous << 8) ^ table[0][previous >> 24];
+		}
+	}
+	return table;
+}();
+
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char* data, size_t size)
+{
+	const auto& table = crc_tables[0];
+	for (size_t i = 0; i < size; ++i)
+		crc = (crc << 8) ^ table[(crc >> 24) ^ data[i]];
+	return crc;
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char* data, size_t size)
+{
+	const auto& t = crc_tables;
+	while (size >= 16) {
+		uint32_t word;
+		memcpy(&word, data, 4);
+		word = be32toh(word) ^ crc;
+		crc = t[15][word >> 24] ^ t[14][(word >> 16) & 0xff] ^
+		      t[13][(word >> 8) & 0xff] ^ t[12][word & 0xff] ^
+		      t[11][data[4]] ^ t[10][data[5]] ^ t[9][data[6]] ^ t[8][data[7]] ^
+		      t[7][data[8]] ^ t[6][data[9]] ^ t[5][data[10]] ^ t[4][data[11]] ^
+		      t[3][data[12]] ^ t[2][data[13]] ^ t[1][data[14]] ^ t[0][data[15]];
+		data += 16;
+		size -= 16;
+	}
+	return crc32_bytewise(crc, data, size);
+}
+
+#ifdef OT_CRC_CLMUL
+
+/** Compute xⁿ mod P, the folding constants of the carry-less multiplication kernel. */
+static constexpr uint32_t x_pow_mod(unsigned n)
+{
+	uint32_t r = 1;
+	for (unsigned i = 0; i < n; ++i)
+		r = (r & 0x80000000) ? (r << 1) ^ polynomial : r << 1;
+	return r;
+}
+
+/**
+ * Multiply the 128-bit polynomial x by x^(distance) modulo P, leaving a polynomial of at most 96
+ * bits that is congruent to it. The high and low halves of x are multiplied by the remainders of
+ * x^(distance+64) and x^(distance) respectively, which constants must contain in that order.
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i fold(__m128i x, __m128i constants)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, constants, 0x11),
+	                     _mm_clmulepi64_si128(x, constants, 0x00));
+}
+
+/**
+ * Load a 128-bit block with its bytes reversed, so that its first byte holds the highest degree
+ * coefficients, matching the most significant bit first order of the Ogg CRC.
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i load(const unsigned char* data, __m128i reverse)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), reverse);
+}
+
+/**
+ * Four blocks are folded in parallel to hide the latency of PCLMULQDQ, then merged into one. The
+ * remaining 128-bit polynomial is stored back in big-endian order, and since the CRC of a byte
+ * sequence only depends on its residue modulo P, the final reduction is left to the table kernel.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_clmul(uint32_t crc, const unsigned char* data, size_t size)
+{
+	if (size < 64)
+		return crc32_slice16(crc, data, size);
+
+	const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i fold_by_4 = _mm_set_epi64x(x_pow_mod(512 + 64), x_pow_mod(512));
+	const __m128i fold_by_1 = _mm_set_epi64x(x_pow_mod(128 + 64), x_pow_mod(128));
+
+	__m128i x0 = _mm_xor_si128(load(data, reverse), _mm_set_epi32(crc, 0, 0, 0));
+	__m128i x1 = load(data + 16, reverse);
+	__m128i x2 = load(data + 32, reverse);
+	__m128i x3 = load(data + 48, reverse);
+	data += 64;
+	size -= 64;
+	while (size >= 64) {
+		x0 = _mm_xor_si128(fold(x0, fold_by_4), load(data, reverse));
+		x1 = _mm_xor_si128(fold(x1, fold_by_4), load(data + 16, reverse));
+		x2 = _mm_xor_si128(fold(x2, fold_by_4), load(data + 32, reverse));
+		x3 = _mm_xor_si128(fold(x3, fold_by_4), load(data + 48, reverse));
+		data += 64;
+		size -= 64;
+	}
+	x0 = _mm_xor_si128(fold(x0, fold_by_1), x1);
+	x0 = _mm_xor_si128(fold(x0, fold_by_1), x2);
+	x0 = _mm_xor_si128(fold(x0, fold_by_1), x3);
+	while (size >= 16) {
+		x0 = _mm_xor_si128(fold(x0, fold_by_1), load(data, reverse));
+		data += 16;
+		size -= 16;
+	}
+
+	alignas(16) unsigned char residue[16];
+	_mm_store_si128(reinterpret_cast<__m128i*>(residue), _mm_shuffle_epi8(x0, reverse));
+	crc = crc32_slice16(0, residue, 16);
+	return crc32_slice16(crc, data, size);
+}
+
+#endif
+
+/** Multiply two polynomials of degree less than 32, modulo P. */
+static constexpr uint32_t multiply_mod(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	for (int i = 31; i >= 0; --i) {
+		r = (r & 0x80000000) ? (r << 1) ^ polynomial : r << 1;
+		if ((b >> i) & 1)
+			r ^= a;
+	}
+	return r;
+}
+
+/** zero_powers[k] is x^(8·2ᵏ) mod P, the effect of 2ᵏ null bytes on a CRC. */
+static constexpr auto zero_powers = [] {
+	std::array<uint32_t, 64> powers {};
+	powers[0] = 1 << 8;
+	for (size_t k = 1; k < powers.size(); ++k)
+		powers[k] = multiply_mod(powers[k - 1], powers[k - 1]);
+	return powers;
+}();
+
+using crc32_kernel = uint32_t (*)(uint32_t, const unsigned char*, size_t);
+
+static crc32_kernel select_kernel()
+{
+#ifdef OT_CRC_CLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+		return crc32_clmul;
+#endif
+	return crc32_slice16;
+}
+
+static const crc32_kernel kernel = select_kernel();
+
+uint32_t ot::ogg_crc32(uint32_t crc, byte_string_view data)
+{
+	return kernel(crc, reinterpret_cast<const unsigned char*>(data.data()), data.size());
+}
+
+uint32_t ot::ogg_crc32_zeros(uint32_t crc, uint64_t length)
+{
+	for (size_t k = 0; length != 0; ++k, length >>= 1) {
+		if (length & 1)
+			crc = multiply_mod(crc, zero_powers[k]);
+	}
+	return crc;
+}
+
+/** Compute the CRC of a page as if its CRC field were zero, without modifying it. */
+static uint32_t page_crc32(const ogg_page& page)
+{
+	static const unsigned char zero[4] = {};
+	uint32_t crc = kernel(0, page.header, 22);
+	crc = kernel(crc, zero, 4);
+	crc = kernel(crc, page.header + 26, page.header_len - 26);
+	return kernel(crc, page.body, page.body_len);
+}
+
+void ot::set_page_checksum(ogg_page& page)
+{
+	uint32_t crc = htole32(page_crc32(page));
+	memcpy(page.header + 22, &crc, 4);
+}
+
+bool ot::check_page_checksum(const ogg_page& page)
+{
+	uint32_t crc;
+	memcpy(&crc, page.header + 22, 4);
+	return le32toh(crc) == page_crc32(page);
+}
@@ -12,6 +12,12 @@
 
 #include <errno.h>
 #include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define OT_OGG_SIMD
+#  include <immintrin.h>
+#endif
 
 bool ot::is_opus_stream(const ogg_page& identification_header)
 {
@@ -22,71 +28,341 @@ bool ot::is_opus_stream(const ogg_page& identification_header)
 	return (memcmp(identification_header.body, "OpusHead", 8) == 0);
 }
 
-bool ot::ogg_reader::next_page()
+ot::page_check ot::parse_page(byte_string_view data, ogg_page& page, bool check_crc)
+{
+	if (data.size() < 27)
+		return page_check::truncated_header;
+	if (data.substr(0, 4) != "OggS"sv)
+		return page_check::missing_capture_pattern;
+	if (data[4] != 0)
+		return page_check::unsupported_version;
+	size_t header_len = 27 + static_cast<unsigned char>(data[26]);
+	if (data.size() < header_len)
+		return page_check::truncated_header;
+	size_t body_len = 0;
+	for (size_t i = 27; i < header_len; ++i)
+		body_len += static_cast<unsigned char>(data[i]);
+
+	page.header = reinterpret_cast<unsigned char*>(const_cast<char*>(data.data()));
+	page.header_len = header_len;
+	page.body = page.header + header_len;
+	page.body_len = std::min(body_len, data.size() - header_len);
+	if (data.size() - header_len < body_len)
+		return page_check::truncated_page;
+	if (check_crc && !check_page_checksum(page))
+		return page_check::checksum_mismatch;
+	return page_check::valid;
+}
+
+const char* ot::page_check_message(page_check check)
+{
+	switch (check) {
+	case page_check::valid: return "valid page";
+	case page_check::truncated_header: return "truncated page header";
+	case page_check::missing_capture_pattern: return "missing capture pattern";
+	case page_check::unsupported_version: return "unsupported stream structure version";
+	case page_check::truncated_page: return "truncated page";
+	case page_check::checksum_mismatch: return "CRC mismatch";
+	}
+	return "invalid page";
+}
+
+bool ot::starts_as_opus_stream(byte_string_view data)
+{
+	for (;;) {
+		ogg_page page;
+		page_check check = parse_page(data, page, false);
+		if (check != page_check::valid && check != page_check::truncated_page)
+			return false;
+		if (is_opus_stream(page))
+			return true;
+		if (!ogg_page_bos(&page) || check == page_check::truncated_page)
+			return false;
+		data.remove_prefix(page.header_len + page.body_len);
+	}
+}
+
+std::optional<int> ot::last_page_serialno(byte_string_view tail)
+{
+	if (tail.size() < 27)
+		return {};
+	for (size_t pos = tail.size() - 27 + 1; pos-- > 0;) {
+		pos = tail.rfind("OggS"sv, pos);
+		if (pos == byte_string_view::npos || tail.size() - pos < 27)
+			return {};
+		// The CRC is only checked once the size of the page matches.
+		ogg_page page;
+		if (parse_page(tail.substr(pos), page, false) != page_check::valid ||
+		    pos + page.header_len + page.body_len != tail.size() || !check_page_checksum(page))
+			continue;
+		return ogg_page_serialno(&page);
+	}
+	return {};
+}
+
+#ifdef OT_OGG_SIMD
+
+/**
+ * Tell which of the 16 positions starting at data hold the capture pattern, as a bit mask. The 3
+ * bytes following the block are read too.
+ */
+static inline unsigned capture_mask_sse2(const char* data)
+{
+	auto matches = [data](int offset, char c) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+		return _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+	};
+	__m128i found = _mm_and_si128(_mm_and_si128(matches(0, 'O'), matches(1, 'g')),
+	                              _mm_and_si128(matches(2, 'g'), matches(3, 'S')));
+	return _mm_movemask_epi8(found);
+}
+
+static size_t find_capture_pattern_sse2(ot::byte_string_view data)
+{
+	size_t i = 0;
+	for (; data.size() - i >= 16 + 3; i += 16) {
+		if (unsigned mask = capture_mask_sse2(data.data() + i))
+			return i + __builtin_ctz(mask);
+	}
+	return data.find("OggS"sv, i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i matches_avx2(const char* data, char c)
+{
+	__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+	return _mm256_cmpeq_epi8(block, _mm256_set1_epi8(c));
+}
+
+/** Like #capture_mask_sse2, for 32 positions. */
+__attribute__((target("avx2")))
+static inline unsigned capture_mask_avx2(const char* data)
+{
+	__m256i found = _mm256_and_si256(
+		_mm256_and_si256(matches_avx2(data, 'O'), matches_avx2(data + 1, 'g')),
+		_mm256_and_si256(matches_avx2(data + 2, 'g'), matches_avx2(data + 3, 'S')));
+	return _mm256_movemask_epi8(found);
+}
+
+__attribute__((target("avx2")))
+static size_t find_capture_pattern_avx2(ot::byte_string_view data)
+{
+	size_t i = 0;
+	for (; data.size() - i >= 32 + 3; i += 32) {
+		if (unsigned mask = capture_mask_avx2(data.data() + i))
+			return i + __builtin_ctz(mask);
+	}
+	return data.find("OggS"sv, i);
+}
+
+#endif
+
+static size_t find_capture_pattern_scalar(ot::byte_string_view data)
+{
+	return data.find("OggS"sv);
+}
+
+using capture_search = size_t (*)(ot::byte_string_view);
+
+static capture_search select_capture_search()
+{
+#ifdef OT_OGG_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find_capture_pattern_avx2;
+	return find_capture_pattern_sse2;
+#endif
+	return find_capture_pattern_scalar;
+}
+
+static const capture_search capture_search_kernel = select_capture_search();
+
+size_t ot::find_capture_pattern(byte_string_view data, size_t offset)
+{
+	if (offset >= data.size())
+		return byte_string_view::npos;
+	size_t found = capture_search_kernel(data.substr(offset));
+	return found == byte_string_view::npos ? found : offset + found;
+}
+
+/** Tell whether the page may still be completed by reading more data. */
+static bool is_truncated(ot::page_check check)
+{
+	return check == ot::page_check::truncated_header || check == ot::page_check::truncated_page;
+}
+
+static ot::status unsynced_data(const ot::ogg_reader& reader)
+{
+	return {ot::st::bad_stream, reader.absolute_page_no == -1 ? "Input is not a valid Ogg file."
+	                                                          : "Unsynced data in stream."};
+}
+
+/**
+ * Parse the next page from the buffer, reading the file into it when it runs out of data.
+ */
+static bool next_buffered_page(ot::ogg_reader& reader)
 {
-	int rc;
-	while ((rc = ogg_sync_pageout(&sync, &page)) != 1) {
-		if (rc == -1) {
-			throw status {st::bad_stream,
-			              absolute_page_no == -1 ? "Input is not a valid Ogg file."
-			                                     : "Unsynced data in stream."};
+	for (;;) {
+		ot::byte_string_view data(reinterpret_cast<const char*>(reader.buffer.get()) + reader.buffer_start,
+		                          reader.buffer_end - reader.buffer_start);
+		ot::page_check result = ot::parse_page(data, reader.page);
+		if (result == ot::page_check::valid) {
+			reader.buffer_start += reader.page.header_len + reader.page.body_len;
+			return true;
+		}
+		if (!is_truncated(result))
+			throw unsynced_data(reader);
+		if (feof(reader.file)) {
+			if (!data.empty())
+				throw ot::status {ot::st::bad_stream, "Unsynced data at end of stream."};
+			return false; // end of stream
 		}
-		if (ogg_sync_check(&sync) != 0)
-			throw status {st::libogg_error, "ogg_sync_check signalled an error."};
-		if (feof(file)) {
-			if (sync.fill != sync.returned)
-				throw status {st::bad_stream, "Unsynced data at end of stream."};
-			return false; // end of sream
+		if (!reader.buffer)
+			reader.buffer = std::make_unique_for_overwrite<unsigned char[]>(ot::ogg_reader::buffer_size);
+		// The unfinished page is moved to make room for the read, and is smaller than a page.
+		if (ot::ogg_reader::buffer_size - reader.buffer_end < reader.read_size) {
+			memmove(reader.buffer.get(), data.data(), data.size());
+			reader.buffer_start = 0;
+			reader.buffer_end = data.size();
 		}
-		char* buf = ogg_sync_buffer(&sync, 65536);
-		if (buf == nullptr)
-			throw status {st::libogg_error, "ogg_sync_buffer failed."};
-		size_t len = fread(buf, 1, 65536, file);
-		if (ferror(file))
-			throw status {st::standard_error, "fread error: "s + strerror(errno)};
-		if (ogg_sync_wrote(&sync, len) != 0)
-			throw status {st::libogg_error, "ogg_sync_wrote failed."};
+		size_t len = fread(reader.buffer.get() + reader.buffer_end, 1, reader.read_size, reader.file);
+		if (ferror(reader.file))
+			throw ot::status {ot::st::standard_error, "fread error: "s + strerror(errno)};
+		reader.buffer_end += len;
+		reader.bytes_read += len;
+		reader.read_size = std::min(reader.read_size * 2, ot::ogg_reader::max_read_size);
 	}
+}
+
+/**
+ * Parse the next page straight from the mapped input. The checks are the same as for the buffered
+ * input.
+ */
+static bool next_mapped_page(ot::ogg_reader& reader)
+{
+	ot::byte_string_view data = reader.mapping.data().substr(reader.mapping_offset);
+	if (data.empty())
+		return false;
+	ogg_page& page = reader.page;
+	ot::page_check result = ot::parse_page(data, page);
+	if (is_truncated(result))
+		throw ot::status {ot::st::bad_stream, "Unsynced data at end of stream."};
+	if (result != ot::page_check::valid)
+		throw unsynced_data(reader);
+	memcpy(reader.header_buffer, page.header, page.header_len);
+	page.header = reader.header_buffer;
+	reader.mapping_offset += page.header_len + page.body_len;
+	reader.bytes_read += page.header_len + page.body_len;
+	return true;
+}
+
+bool ot::ogg_reader::next_page()
+{
+	long previous_page_size = absolute_page_no == -1 ? 0 : page.header_len + page.body_len;
+	if (!(mapping.data().empty() ? next_buffered_page(*this) : next_mapped_page(*this)))
+		return false;
 	++absolute_page_no;
+	page_offset += previous_page_size;
+	return true;
+}
+
+bool ot::ogg_reader::map_input()
+{
+	int fd = fileno(file);
+	if (absolute_page_no != -1 || fd == -1 || !mapping.map(fd))
+		return false;
+	off_t start = ftello(file);
+	if (start == -1 || static_cast<size_t>(start) >= mapping.data().size()) {
+		mapping.unmap();
+		return false;
+	}
+	mapping_offset = start;
 	return true;
 }
 
-void ot::ogg_reader::process_header_packet(const std::function<void(ogg_packet&)>& f)
+/**
+ * The end of the packet is found in the lacing values: it is the first segment shorter than 255
+ * bytes. When all the segments of a page are 255 bytes long, the packet continues on the next page
+ * of the stream, which must directly follow the page and be flagged as continued.
+ */
+void ot::ogg_reader::process_header_pages(const std::function<void(byte_string_view)>& f,
+                                          const std::function<void(const ogg_page&)>& foreign)
 {
 	if (ogg_page_continued(&page))
 		throw status {ot::st::error, "Unexpected continued header page."};
 
-	ogg_packet packet;
-	ogg_logical_stream stream(ogg_page_serialno(&page));
-	stream.pageno = ogg_page_pageno(&page);
-
+	int serialno = ogg_page_serialno(&page);
 	for (;;) {
-		if (ogg_stream_pagein(&stream, &page) != 0)
-			throw status {st::libogg_error, "ogg_stream_pagein failed."};
-
-		int rc = ogg_stream_packetout(&stream, &packet);
-		if (ogg_stream_check(&stream) != 0 || rc == -1) {
-			throw status {ot::st::libogg_error, "ogg_stream_packetout failed."};
-		} else if (rc == 0) {
-			// Not enough data: read the next page.
+		size_t segments = page.header[26];
+		size_t size = 0;
+		size_t used = 0;
+		while (used < segments && page.header[27 + used] == 255)
+			size += page.header[27 + used++];
+		bool complete = used < segments;
+		if (complete)
+			size += page.header[27 + used++];
+		f(byte_string_view(reinterpret_cast<const char*>(page.body), size));
+		if (complete) {
+			if (used != segments)
+				throw status {ot::st::error, "Header page contains more than a single packet."};
+			return;
+		}
+
+		long pageno = ogg_page_pageno(&page);
+		bool pending = segments != 0;
+		for (;;) {
 			if (!next_page())
 				throw status {ot::st::error, "Unterminated header packet."};
-			continue;
-		} else {
-			// The packet was successfully read.
-			break;
+			if (ogg_page_serialno(&page) == serialno)
+				break;
+			if (foreign)
+				foreign(page);
 		}
+		if (ogg_page_pageno(&page) != pageno + 1)
+			throw status {ot::st::bad_stream, "Missing page in the header packet."};
+		if (ogg_page_continued(&page) != pending)
+			throw status {ot::st::bad_stream, pending ? "Header page does not continue the packet."
+			                                          : "Unexpected continued header page."};
 	}
+}
 
+void ot::ogg_reader::process_header_packet(const std::function<void(ogg_packet&)>& f,
+                                           const std::function<void(const ogg_page&)>& foreign)
+{
+	bool bos = ogg_page_bos(&page);
+	byte_string data;
+	process_header_pages([&](byte_string_view piece) { data.append(piece); }, foreign);
+	ogg_packet packet {};
+	packet.packet = reinterpret_cast<unsigned char*>(data.data());
+	packet.bytes = data.size();
+	packet.b_o_s = bos;
+	packet.e_o_s = ogg_page_eos(&page);
+	packet.granulepos = ogg_page_granulepos(&page);
 	f(packet);
+}
+
+static void write_data(FILE* file, const void* data, size_t size)
+{
+	if (fwrite(data, 1, size, file) < size)
+		throw ot::status {ot::st::standard_error, "fwrite error: "s + strerror(errno)};
+}
 
-	/* Ensure that there are no other segments left in the packet using the lacing state of the
-	 * stream. These are the relevant variables, as far as I understood them:
-	 *  - lacing_vals: extensible array containing the lacing values of the segments,
-	 *  - lacing_fill: number of elements in lacing_vals (not the capacity),
-	 *  - lacing_returned: index of the next segment to be processed. */
-	if (stream.lacing_returned != stream.lacing_fill)
-		throw status {ot::st::error, "Header page contains more than a single packet."};
+static void write_batch(ot::ogg_writer& writer)
+{
+	if (writer.batch_fill == 0)
+		return;
+	size_t size = writer.batch_fill;
+	writer.batch_fill = 0;
+	write_data(writer.file, writer.batch.get(), size);
+}
+
+ot::ogg_writer::~ogg_writer()
+{
+	try {
+		flush();
+	} catch (const status&) {
+		// The caller would have called flush if it cared about the output.
+	}
 }
 
 void ot::ogg_writer::write_page(const ogg_page& page)
@@ -95,32 +371,91 @@ void ot::ogg_writer::write_page(const ogg_page& page)
 		throw status {st::int_overflow, "Overflowing page length"};
 
 	long pageno = ogg_page_pageno(&page);
-	if (pageno != next_page_no)
-		fprintf(stderr, "Output page number mismatch: expected %ld, got %ld.\n", next_page_no, pageno);
-	next_page_no = pageno + 1;
+	long& expected_pageno = next_page_no[ogg_page_serialno(&page)];
+	if (pageno != expected_pageno)
+		fprintf(thread_stderr, "Output page number mismatch: expected %ld, got %ld.\n", expected_pageno, pageno);
+	expected_pageno = pageno + 1;
 
 	auto header_len = static_cast<size_t>(page.header_len);
 	auto body_len = static_cast<size_t>(page.body_len);
-	if (fwrite(page.header, 1, header_len, file) < header_len)
-		throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
-	if (fwrite(page.body, 1, body_len, file) < body_len)
-		throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
+	if (batch_size - batch_fill < header_len + body_len)
+		write_batch(*this);
+	if (header_len + body_len > batch_size) {
+		write_data(file, page.header, header_len);
+		write_data(file, page.body, body_len);
+		return;
+	}
+	if (!batch)
+		batch = std::make_unique_for_overwrite<unsigned char[]>(batch_size);
+	memcpy(batch.get() + batch_fill, page.header, header_len);
+	memcpy(batch.get() + batch_fill + header_len, page.body, body_len);
+	batch_fill += header_len + body_len;
 }
 
-void ot::ogg_writer::write_header_packet(int serialno, int pageno, ogg_packet& packet)
+void ot::ogg_writer::flush()
 {
-	ogg_logical_stream stream(serialno);
-	stream.b_o_s = (pageno != 0);
-	stream.pageno = pageno;
-	if (ogg_stream_packetin(&stream, &packet) != 0)
-		throw status {ot::st::libogg_error, "ogg_stream_packetin failed"};
+	write_batch(*this);
+	if (fflush(file) != 0)
+		throw status {st::standard_error, "fflush error: "s + strerror(errno)};
+}
 
-	ogg_page page;
-	while (ogg_stream_flush(&stream, &page) != 0)
+void ot::ogg_writer::write_header_packet(int serialno, int pageno, ogg_packet& packet)
+{
+	paginate_header_packet(serialno, pageno, packet, [this](const ogg_page& page) {
 		write_page(page);
+	});
+}
+
+ot::header_pages ot::header_pages_layout(size_t packet_size)
+{
+	size_t segments = packet_size / 255 + 1;
+	size_t count = (segments + 254) / 255;
+	return {static_cast<long>(count), 27 * count + segments + packet_size};
+}
 
-	if (ogg_stream_check(&stream) != 0)
-		throw status {st::libogg_error, "ogg_stream_check failed"};
+/**
+ * libogg’s ogg_stream_flush puts 255 segments on every page of a lone packet, except the last one.
+ * Only the page that completes the packet carries its granule position, and the pages after the
+ * first one are flagged as continued.
+ */
+void ot::paginate_header_packet(int serialno, int pageno, const ogg_packet& packet,
+                                const std::function<void(const ogg_page&)>& f)
+{
+	size_t packet_size = packet.bytes;
+	size_t segments = packet_size / 255 + 1;
+	unsigned char header[27 + 255];
+	memcpy(header, "OggS", 5);
+	uint32_t serial = htole32(serialno);
+	memcpy(header + 14, &serial, 4);
+
+	size_t offset = 0;
+	for (size_t done = 0; done < segments; ++pageno) {
+		size_t count = std::min<size_t>(255, segments - done);
+		bool first = done == 0;
+		done += count;
+		bool last = done == segments;
+		size_t body_len = last ? packet_size - offset : 255 * count;
+		header[5] = (first ? 0 : 0x01) | (first && pageno == 0 ? 0x02 : 0) |
+		            (last && packet.e_o_s ? 0x04 : 0);
+		// libogg zeroes the granule position of the first page of the stream.
+		uint64_t granulepos = htole64(pageno == 0 ? 0 : last ? packet.granulepos : -1);
+		memcpy(header + 6, &granulepos, 8);
+		uint32_t le_pageno = htole32(pageno);
+		memcpy(header + 18, &le_pageno, 4);
+		header[26] = count;
+		memset(header + 27, 255, count);
+		if (last)
+			header[27 + count - 1] = packet_size % 255;
+
+		ogg_page page;
+		page.header = header;
+		page.header_len = 27 + count;
+		page.body = packet.packet + offset;
+		page.body_len = body_len;
+		set_page_checksum(page);
+		f(page);
+		offset += body_len;
+	}
 }
 
 void ot::renumber_page(ogg_page& page, long new_pageno)
@@ -132,6 +467,17 @@ void ot::renumber_page(ogg_page& page, long new_pageno)
 
 	/** The pageno field is located at bytes 18 to 21 (0-indexed, little-endian). */
 	uint32_t le_pageno = htole32(new_pageno);
+	unsigned char delta[4];
+	memcpy(delta, &le_pageno, 4);
+	for (size_t i = 0; i < 4; ++i)
+		delta[i] ^= page.header[18 + i];
 	memcpy(&page.header[18], &le_pageno, 4);
-	ogg_page_checksum_set(&page);
+
+	// Patch the CRC with the contribution of the modified bytes rather than reading the page.
+	uint32_t crc;
+	memcpy(&crc, &page.header[22], 4);
+	uint32_t crc_delta = ogg_crc32(0, byte_string_view(reinterpret_cast<char*>(delta), 4));
+	crc_delta = ogg_crc32_zeros(crc_delta, page.header_len + page.body_len - 22);
+	crc = htole32(le32toh(crc) ^ crc_delta);
+	memcpy(&page.header[22], &crc, 4);
 }
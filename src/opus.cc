@@ -26,12 +26,152 @@
 #include <string.h>
 #include <algorithm>
 
+ot::comment_list::comment_list(std::initializer_list<std::u8string_view> comments)
+{
+	entries.reserve(comments.size());
+	for (std::u8string_view comment : comments)
+		push_back(comment);
+}
+
+ot::comment_list::comment_list(const std::list<std::u8string>& comments)
+{
+	entries.reserve(comments.size());
+	for (const std::u8string& comment : comments)
+		push_back(comment);
+}
+
+ot::comment_list::operator std::list<std::u8string>() const
+{
+	return {begin(), end()};
+}
+
+void ot::comment_list::push_back(std::u8string_view comment)
+{
+	if (comment.size() > UINT32_MAX)
+		throw status {st::int_overflow, "Comment too long"};
+	uint32_t n = htole32(comment.size());
+	arena.append(reinterpret_cast<const char*>(&n), 4);
+	entries.push_back({arena.size(), comment.size(), origin::arena});
+	arena.append(reinterpret_cast<const char*>(comment.data()), comment.size());
+	total_size += 4 + comment.size();
+}
+
+void ot::comment_list::push_back(deferred_comment comment)
+{
+	if (comment.size > UINT32_MAX)
+		throw status {st::int_overflow, "Comment too long"};
+	entries.push_back({deferred.size(), comment.size, origin::deferred});
+	total_size += 4 + comment.size;
+	deferred.push_back({std::move(comment), nullptr});
+}
+
+std::u8string_view ot::comment_list::text(const entry& e) const
+{
+	const char* data;
+	if (e.from == origin::deferred) {
+		const deferred_entry& d = deferred[e.offset];
+		if (!d.text) {
+			d.text = std::make_unique<char[]>(e.length);
+			d.comment.write(d.text.get());
+		}
+		data = d.text.get();
+	} else {
+		data = (e.from == origin::packet ? borrowed.data() : arena.data()) + e.offset;
+	}
+	return {reinterpret_cast<const char8_t*>(data), e.length};
+}
+
+void ot::comment_list::clear()
+{
+	borrowed = {};
+	arena.clear();
+	deferred.clear();
+	entries.clear();
+	total_size = 0;
+}
+
+/**
+ * The borrowed comments stay where they are in the packet, while the comments of the arena are
+ * moved towards its beginning to fill the gaps.
+ */
+void ot::comment_list::remove_if(const std::function<bool(std::u8string_view)>& predicate)
+{
+	size_t arena_size = 0;
+	total_size = 0;
+	auto kept = entries.begin();
+	for (const entry& e : entries) {
+		if (predicate(text(e)))
+			continue;
+		entry moved = e;
+		if (e.from == origin::arena) {
+			memmove(&arena[arena_size], &arena[e.offset - 4], 4 + e.length);
+			moved.offset = arena_size + 4;
+			arena_size += 4 + e.length;
+		}
+		*kept++ = moved;
+		total_size += 4 + e.length;
+	}
+	entries.erase(kept, entries.end());
+	arena.resize(arena_size);
+}
+
+void ot::comment_list::detach()
+{
+	if (borrowed.empty())
+		return;
+	arena.reserve(arena.size() + borrowed.size());
+	for (entry& e : entries) {
+		if (e.from != origin::packet)
+			continue;
+		arena.append(borrowed.substr(e.offset - 4, 4 + e.length));
+		e = {arena.size() - e.length, e.length, origin::arena};
+	}
+	borrowed = {};
+}
+
+/**
+ * Copy the runs of comments that follow each other in the packet or the arena at once, and let
+ * the deferred comments write themselves in place.
+ */
+void ot::comment_list::render(char* out) const
+{
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (it->from == origin::deferred) {
+			uint32_t n = htole32(it->length);
+			memcpy(out, &n, 4);
+			const deferred_entry& d = deferred[it->offset];
+			if (d.text)
+				memcpy(out + 4, d.text.get(), it->length);
+			else
+				d.comment.write(out + 4);
+			out += 4 + it->length;
+			++it;
+			continue;
+		}
+		origin from = it->from;
+		size_t start = it->offset - 4;
+		size_t end = it->offset + it->length;
+		for (++it; it != entries.end() && it->from == from && it->offset - 4 == end; ++it)
+			end = it->offset + it->length;
+		memcpy(out, (from == origin::packet ? borrowed.data() : arena.data()) + start, end - start);
+		out += end - start;
+	}
+}
+
 ot::opus_tags ot::parse_tags(const ogg_packet& packet)
 {
 	if (packet.bytes < 0)
 		throw status {st::int_overflow, "Overflowing comment header length"};
-	size_t size = static_cast<size_t>(packet.bytes);
-	const uint8_t* data = reinterpret_cast<uint8_t*>(packet.packet);
+	opus_tags tags = parse_tags_view(byte_string_view(reinterpret_cast<const char*>(packet.packet),
+	                                             packet.bytes));
+	tags.comments.detach();
+	return tags;
+}
+
+ot::opus_tags ot::parse_tags_view(byte_string_view packet)
+{
+	size_t size = packet.size();
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(packet.data());
 	size_t pos = 0;
 	opus_tags my_tags;
 
@@ -60,7 +200,11 @@ ot::opus_tags ot::parse_tags(const ogg_packet& packet)
 	count = le32toh(count);
 	pos += 4;
 
-	// Comments' data
+	// Comments' data, indexed but left in the packet. The count is not trusted for the
+	// reservation beyond what the packet could possibly hold.
+	size_t comments_start = pos;
+	comment_list& comments = my_tags.comments;
+	comments.entries.reserve(std::min<size_t>(count, (size - pos) / 4));
 	for (uint32_t i = 0; i < count; ++i) {
 		if (pos + 4 > size)
 			throw status {st::cut_comment_length,
@@ -71,10 +215,12 @@ ot::opus_tags ot::parse_tags(const ogg_packet& packet)
 		if (pos + 4 + comment_length > size)
 			throw status {st::cut_comment_data,
 			              "Comment string did not fit the comment header"};
-		auto comment_value = reinterpret_cast<const char8_t*>(&data[pos + 4]);
-		my_tags.comments.emplace_back(comment_value, comment_length);
+		comments.entries.push_back({pos + 4 - comments_start, comment_length,
+		                            comment_list::origin::packet});
 		pos += 4 + comment_length;
 	}
+	comments.borrowed = packet.substr(comments_start, pos - comments_start);
+	comments.total_size = comments.borrowed.size();
 
 	// Extra data
 	my_tags.extra_data = byte_string(reinterpret_cast<const char*>(data + pos), size - pos);
@@ -82,14 +228,149 @@ ot::opus_tags ot::parse_tags(const ogg_packet& packet)
 	return my_tags;
 }
 
-ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
+ot::opus_tags_parser::opus_tags_parser(opus_tags& tags,
+                                       std::function<void(std::u8string_view)> on_comment)
+	: tags(tags), on_comment(std::move(on_comment))
 {
-	size_t size = 8 + 4 + tags.vendor.size() + 4;
-	for (const std::u8string& comment : tags.comments)
-		size += 4 + comment.size();
-	size += tags.extra_data.size();
+}
 
-	dynamic_ogg_packet op(size);
+/**
+ * Largest allocation made ahead of the data on the basis of a length read from the packet, which
+ * may be corrupted.
+ */
+static constexpr size_t max_reservation = 256 << 20;
+
+/**
+ * The fields are read as soon as they are complete. Those contained in the piece are read from it
+ * directly, and the others are first completed in the buffer, except for the comments kept in the
+ * tags, which are written straight into the arena of the list.
+ */
+void ot::opus_tags_parser::feed(byte_string_view piece)
+{
+	fed += piece.size();
+	for (;;) {
+		if (expected == field::extra_data) {
+			tags.extra_data.append(piece);
+			return;
+		}
+		if (expected == field::comment && !on_comment) {
+			size_t n = std::min(needed, piece.size());
+			tags.comments.arena.append(piece.substr(0, n));
+			piece.remove_prefix(n);
+			needed -= n;
+			if (needed > 0)
+				return;
+			--remaining_comments;
+			expected = remaining_comments == 0 ? field::extra_data : field::comment_length;
+			needed = 4;
+			continue;
+		}
+		if (buffer.empty() && piece.size() >= needed) {
+			byte_string_view data = piece.substr(0, needed);
+			piece.remove_prefix(needed);
+			read(data);
+			continue;
+		}
+		if (piece.empty())
+			return;
+		if (buffer.empty())
+			buffer.reserve(std::min(needed, max_reservation));
+		size_t n = std::min(needed - buffer.size(), piece.size());
+		buffer.append(piece.substr(0, n));
+		piece.remove_prefix(n);
+		if (buffer.size() < needed)
+			return;
+		read(buffer);
+		buffer.clear();
+	}
+}
+
+/** Process a complete field, and set up the next one. */
+void ot::opus_tags_parser::read(byte_string_view data)
+{
+	auto as_u32 = [&] {
+		uint32_t n;
+		memcpy(&n, data.data(), 4);
+		return le32toh(n);
+	};
+	auto next_comment = [&] {
+		expected = remaining_comments == 0 ? field::extra_data : field::comment_length;
+		needed = 4;
+	};
+	switch (expected) {
+	case field::magic:
+		if (data != "OpusTags"sv)
+			throw status {st::bad_magic_number, "Comment header did not start with OpusTags"};
+		expected = field::vendor_length;
+		needed = 4;
+		break;
+	case field::vendor_length:
+		expected = field::vendor;
+		needed = as_u32();
+		break;
+	case field::vendor:
+		tags.vendor.assign(reinterpret_cast<const char8_t*>(data.data()), data.size());
+		expected = field::count;
+		needed = 4;
+		break;
+	case field::count:
+		remaining_comments = as_u32();
+		next_comment();
+		break;
+	case field::comment_length:
+		expected = field::comment;
+		needed = as_u32();
+		if (!on_comment) {
+			// The comment is then written into the arena by feed as it comes.
+			comment_list& list = tags.comments;
+			if (list.arena.capacity() - list.arena.size() < 4 + needed)
+				list.arena.reserve(list.arena.size() + std::max(4 + std::min(needed, max_reservation),
+				                                                list.arena.size()));
+			list.arena.append(data);
+			list.entries.push_back({list.arena.size(), needed, comment_list::origin::arena});
+			list.total_size += 4 + needed;
+		}
+		break;
+	case field::comment: {
+		on_comment(std::u8string_view(reinterpret_cast<const char8_t*>(data.data()), data.size()));
+		--remaining_comments;
+		next_comment();
+		break;
+	}
+	case field::extra_data:
+		break;
+	}
+}
+
+void ot::opus_tags_parser::finish()
+{
+	switch (expected) {
+	case field::magic:
+		throw status {st::cut_magic_number, "Comment header too short for the magic number"};
+	case field::vendor_length:
+		throw status {st::cut_vendor_length,
+		              "Vendor string length did not fit the comment header"};
+	case field::vendor:
+		throw status {st::cut_vendor_data, "Vendor string did not fit the comment header"};
+	case field::count:
+		throw status {st::cut_comment_count, "Comment count did not fit the comment header"};
+	case field::comment_length:
+		throw status {st::cut_comment_length, "Comment length did not fit the comment header"};
+	case field::comment:
+		throw status {st::cut_comment_data, "Comment string did not fit the comment header"};
+	case field::extra_data:
+		break;
+	}
+}
+
+size_t ot::rendered_size(const opus_tags& tags)
+{
+	return 8 + 4 + tags.vendor.size() + 4 + tags.comments.rendered_size() + tags.extra_data.size();
+}
+
+ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
+{
+	dynamic_ogg_packet op(rendered_size(tags));
 	op.b_o_s = 0;
 	op.e_o_s = 0;
 	op.granulepos = 0;
@@ -105,17 +386,111 @@ ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
 	n = htole32(tags.comments.size());
 	memcpy(data, &n, 4);
 	data += 4;
-	for (const std::u8string& comment : tags.comments) {
-		n = htole32(comment.size());
-		memcpy(data, &n, 4);
-		memcpy(data+4, comment.data(), comment.size());
-		data += 4 + comment.size();
-	}
+	tags.comments.render(reinterpret_cast<char*>(data));
+	data += tags.comments.rendered_size();
 	memcpy(data, tags.extra_data.data(), tags.extra_data.size());
 
 	return op;
 }
 
+bool ot::resize_padding(opus_tags& tags, size_t packet_size)
+{
+	size_t current_size = rendered_size(tags);
+	if (current_size == packet_size)
+		return true;
+	if (tags.extra_data.empty() || (tags.extra_data[0] & 1) != 0)
+		return false; // No padding, or data that must be preserved.
+	size_t base_size = current_size - tags.extra_data.size();
+	if (packet_size < base_size)
+		return false;
+	tags.extra_data.resize(packet_size - base_size, '\0');
+	return true;
+}
+
+ot::comment_selector::comment_selector(std::u8string_view selector, bool prefix)
+	: prefix(prefix)
+{
+	auto equal = selector.find(u8'=');
+	name = selector.substr(0, equal);
+	if (equal != std::u8string_view::npos)
+		value = selector.substr(equal + 1);
+}
+
+bool ot::comment_selector::matches(std::u8string_view comment) const
+{
+	/** \todo Avoid using strncasecmp because it assumes the system locale is UTF-8. */
+	bool name_match = comment.size() > name.size() + 1 &&
+	                  comment[name.size()] == '=' &&
+	                  strncasecmp((const char*) comment.data(), (const char*) name.data(), name.size()) == 0;
+	if (!name_match || !value)
+		return name_match;
+	comment.remove_prefix(name.size() + 1);
+	if (prefix ? comment.size() < value->size() : comment.size() != value->size())
+		return false;
+	return memcmp(comment.data(), value->data(), value->size()) == 0;
+}
+
+bool ot::match_tags(byte_string_view packet, const std::vector<comment_selector>& selectors)
+{
+	const char* data = packet.data();
+	size_t size = packet.size();
+	if (size < 8)
+		throw status {st::cut_magic_number, "Comment header too short for the magic number"};
+	if (memcmp(data, "OpusTags", 8) != 0)
+		throw status {st::bad_magic_number, "Comment header did not start with OpusTags"};
+	if (size < 12)
+		throw status {st::cut_vendor_length,
+		              "Vendor string length did not fit the comment header"};
+	uint32_t vendor_length;
+	memcpy(&vendor_length, data + 8, 4);
+	vendor_length = le32toh(vendor_length);
+	if (size - 12 < vendor_length)
+		throw status {st::cut_vendor_data, "Vendor string did not fit the comment header"};
+	size_t pos = 12 + vendor_length;
+	if (size - pos < 4)
+		throw status {st::cut_comment_count, "Comment count did not fit the comment header"};
+	uint32_t count;
+	memcpy(&count, data + pos, 4);
+	count = le32toh(count);
+	pos += 4;
+
+	std::vector<bool> matched(selectors.size(), false);
+	size_t remaining = selectors.size();
+	for (uint32_t i = 0; i < count && remaining > 0; ++i) {
+		if (size - pos < 4)
+			throw status {st::cut_comment_length,
+			              "Comment length did not fit the comment header"};
+		uint32_t comment_length;
+		memcpy(&comment_length, data + pos, 4);
+		comment_length = le32toh(comment_length);
+		pos += 4;
+		if (size - pos < comment_length)
+			throw status {st::cut_comment_data,
+			              "Comment string did not fit the comment header"};
+		std::u8string_view comment(reinterpret_cast<const char8_t*>(data + pos), comment_length);
+		for (size_t j = 0; j < selectors.size(); ++j) {
+			if (!matched[j] && selectors[j].matches(comment)) {
+				matched[j] = true;
+				--remaining;
+			}
+		}
+		pos += comment_length;
+	}
+	return remaining == 0;
+}
+
+namespace {
+
+/** Position of the variable-length fields of a picture block. */
+struct picture_layout {
+	size_t mime_offset;
+	size_t mime_size;
+	size_t picture_offset;
+	size_t picture_size;
+};
+
+}
+
 /**
  * The METADATA_BLOCK_PICTURE binary data, after base64 decoding, is organized like this:
  *
@@ -126,58 +501,80 @@ ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
  *  - 4 + n bytes for the picture data.
  *
  * Integers are all big endian.
+ *
+ * The block of the given size is read through read_u32, which returns the big-endian integer at
+ * the given offset, so that the block needs not be decoded entirely.
  */
-ot::picture::picture(ot::byte_string block)
-	: storage(std::move(block))
+template <typename F>
+static picture_layout parse_picture_block(size_t size, F read_u32)
 {
 	size_t mime_offset = 4;
-	if (storage.size() < mime_offset + 4)
-		throw status { st::invalid_size, "missing MIME type in picture block" };
-	uint32_t mime_size = be32toh(*reinterpret_cast<const uint32_t*>(&storage[mime_offset]));
+	if (size < mime_offset + 4)
+		throw ot::status { ot::st::invalid_size, "missing MIME type in picture block" };
+	uint32_t mime_size = read_u32(mime_offset);
 
 	size_t desc_offset = mime_offset + 4 + mime_size;
-	if (storage.size() < desc_offset + 4)
-		throw status { st::invalid_size, "missing description in picture block" };
-	uint32_t desc_size;
-	memcpy(&desc_size, &storage[desc_offset], sizeof(desc_size));
-	desc_size = be32toh(desc_size);
+	if (size < desc_offset + 4)
+		throw ot::status { ot::st::invalid_size, "missing description in picture block" };
+	uint32_t desc_size = read_u32(desc_offset);
 
 	size_t pic_offset = desc_offset + 4 + desc_size + 16;
-	if (storage.size() < pic_offset + 4)
-		throw status { st::invalid_size, "missing picture data in picture block" };
-	uint32_t pic_size;
-	memcpy(&pic_size, &storage[pic_offset], sizeof(pic_size));
-	pic_size = be32toh(pic_size);
+	if (size < pic_offset + 4)
+		throw ot::status { ot::st::invalid_size, "missing picture data in picture block" };
+	uint32_t pic_size = read_u32(pic_offset);
 
-	if (storage.size() != pic_offset + 4 + pic_size)
-		throw status { st::invalid_size, "invalid picture block size" };
+	if (size != pic_offset + 4 + pic_size)
+		throw ot::status { ot::st::invalid_size, "invalid picture block size" };
 
-	mime_type = byte_string_view(&storage[mime_offset + 4], mime_size);
-	picture_data = byte_string_view(&storage[pic_offset + 4], pic_size);
+	return {mime_offset + 4, mime_size, pic_offset + 4, pic_size};
 }
 
-ot::byte_string ot::picture::serialize() const
+ot::picture::picture(ot::byte_string block)
+	: storage(std::move(block))
+{
+	picture_layout layout = parse_picture_block(storage.size(), [&](size_t offset) {
+		uint32_t n;
+		memcpy(&n, &storage[offset], sizeof(n));
+		return be32toh(n);
+	});
+	mime_type = byte_string_view(&storage[layout.mime_offset], layout.mime_size);
+	picture_data = byte_string_view(&storage[layout.picture_offset], layout.picture_size);
+}
+
+/**
+ * Build the fields of a picture block that precede the picture data, for a front cover without
+ * description nor attributes.
+ */
+static ot::byte_string picture_block_header(ot::byte_string_view mime_type, size_t picture_size)
 {
-	ot::byte_string bytes;
 	size_t mime_offset = 4;
 	size_t pic_offset = mime_offset + 4 + mime_type.size() + 4 + 0 + 16;
-	bytes.resize(pic_offset + 4 + picture_data.size());
+	ot::byte_string bytes(pic_offset + 4, '\0');
 	*reinterpret_cast<uint32_t*>(&bytes[0]) = htobe32(3); // Picture type: front cover.
 	*reinterpret_cast<uint32_t*>(&bytes[mime_offset]) = htobe32(mime_type.size());
 	std::copy(mime_type.begin(), mime_type.end(), std::next(bytes.begin(), mime_offset + 4));
-	uint32_t picture_data_size = htobe32(picture_data.size());
+	uint32_t picture_data_size = htobe32(picture_size);
 	memcpy(&bytes[pic_offset], &picture_data_size, sizeof(picture_data_size));
-	std::copy(picture_data.begin(), picture_data.end(), std::next(bytes.begin(), pic_offset + 4));
 	return bytes;
 }
 
+ot::byte_string ot::picture::serialize() const
+{
+	ot::byte_string bytes = picture_block_header(mime_type, picture_data.size());
+	bytes.append(picture_data);
+	return bytes;
+}
+
+static const std::u8string_view cover_prefix = u8"METADATA_BLOCK_PICTURE="sv;
+
 /**
+ * Return the value of the first METADATA_BLOCK_PICTURE tag, still encoded in base64.
+ *
  * \todo Take into account the picture types (first 4 bytes of the tag value).
  */
-std::optional<ot::picture> ot::extract_cover(const ot::opus_tags& tags)
+static std::optional<std::u8string_view> find_cover_value(const ot::opus_tags& tags)
 {
-	static const std::u8string_view prefix = u8"METADATA_BLOCK_PICTURE="sv;
-	auto is_cover = [](const std::u8string& tag) { return tag.starts_with(prefix); };
+	auto is_cover = [](std::u8string_view tag) { return tag.starts_with(cover_prefix); };
 	auto cover_tag = std::find_if(tags.comments.begin(), tags.comments.end(), is_cover);
 	if (cover_tag == tags.comments.end())
 		return {}; // No cover art.
@@ -185,11 +582,52 @@ std::optional<ot::picture> ot::extract_cover(const ot::opus_tags& tags)
 	auto extra_cover_tag = std::find_if(std::next(cover_tag), tags.comments.end(), is_cover);
 	if (extra_cover_tag != tags.comments.end())
 		fputs("warning: Found multiple covers; only the first will be extracted."
-		              " Please report your use case if you need a finer selection.\n", stderr);
+		              " Please report your use case if you need a finer selection.\n", ot::thread_stderr);
 
 	std::u8string_view cover_value = *cover_tag;
-	cover_value.remove_prefix(prefix.size());
-	return picture(decode_base64(cover_value));
+	cover_value.remove_prefix(cover_prefix.size());
+	return cover_value;
+}
+
+std::optional<ot::picture> ot::extract_cover(const ot::opus_tags& tags)
+{
+	std::optional<std::u8string_view> value = find_cover_value(tags);
+	if (!value)
+		return {};
+	return picture(decode_base64(*value));
+}
+
+ot::cover_view::cover_view(std::u8string_view value)
+	: block(value)
+{
+	picture_layout layout = parse_picture_block(block.size(), [&](size_t offset) {
+		uint32_t n;
+		block.read(offset, sizeof(n), reinterpret_cast<char*>(&n));
+		return be32toh(n);
+	});
+	mime_type.resize(layout.mime_size);
+	block.read(layout.mime_offset, layout.mime_size, mime_type.data());
+	picture_offset = layout.picture_offset;
+	picture_size = layout.picture_size;
+}
+
+void ot::cover_view::read_picture(const std::function<void(byte_string_view)>& sink,
+                                  size_t chunk_size) const
+{
+	byte_string chunk(std::min(chunk_size, picture_size), '\0');
+	for (size_t done = 0; done < picture_size; done += chunk.size()) {
+		size_t n = std::min(chunk.size(), picture_size - done);
+		block.read(picture_offset + done, n, chunk.data());
+		sink(byte_string_view(chunk.data(), n));
+	}
+}
+
+std::optional<ot::cover_view> ot::find_cover(const opus_tags& tags)
+{
+	std::optional<std::u8string_view> value = find_cover_value(tags);
+	if (!value)
+		return {};
+	return cover_view(*value);
 }
 
 /**
@@ -208,14 +646,44 @@ static ot::byte_string_view detect_mime_type(ot::byte_string_view data)
 		if (data.starts_with(magic))
 			return mime;
 	}
-	fputs("warning: Could not identify the MIME type of the picture; defaulting to application/octet-stream.\n", stderr);
+	fputs("warning: Could not identify the MIME type of the picture; defaulting to application/octet-stream.\n", ot::thread_stderr);
 	return "application/octet-stream"sv;
 }
 
+/**
+ * Build the METADATA_BLOCK_PICTURE comment of the picture without serializing its picture block:
+ * the fields of the block and the picture data are encoded one after the other, straight into the
+ * output. The few bytes at their junction are encoded together so that the base64 groups line up.
+ *
+ * The picture data must outlive the comment, unless owner keeps it alive.
+ */
+static ot::comment_list::deferred_comment cover_comment(ot::byte_string_view picture_data,
+                                                        std::shared_ptr<const void> owner)
+{
+	ot::byte_string header = picture_block_header(detect_mime_type(picture_data), picture_data.size());
+	size_t block_size = header.size() + picture_data.size();
+	size_t size = cover_prefix.size() + (block_size + 2) / 3 * 4;
+	return {size, [header = std::move(header), picture_data, owner](char* out) {
+		memcpy(out, cover_prefix.data(), cover_prefix.size());
+		char8_t* pos = reinterpret_cast<char8_t*>(out) + cover_prefix.size();
+		size_t junction = std::min((3 - header.size() % 3) % 3, picture_data.size());
+		ot::byte_string head = header;
+		head.append(picture_data.substr(0, junction));
+		ot::encode_base64(head, pos);
+		pos += (head.size() + 2) / 3 * 4;
+		ot::encode_base64(picture_data.substr(junction), pos);
+	}};
+}
+
 std::u8string ot::make_cover(ot::byte_string_view picture_data)
 {
-	picture pic;
-	pic.mime_type = detect_mime_type(picture_data);
-	pic.picture_data = picture_data;
-	return u8"METADATA_BLOCK_PICTURE=" + encode_base64(pic.serialize());
+	comment_list::deferred_comment comment = cover_comment(picture_data, nullptr);
+	std::u8string tag(comment.size, u8'\0');
+	comment.write(reinterpret_cast<char*>(tag.data()));
+	return tag;
+}
+
+ot::comment_list::deferred_comment ot::make_cover(std::shared_ptr<const file_contents> picture)
+{
+	return cover_comment(picture->data(), picture);
 }
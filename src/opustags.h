@@ -5,15 +5,18 @@
  *
  * Let's have a quick tour around. The project is split into the following modules:
  *
- * - The system module provides a few generic tools for interating with the system.
- * - The ogg module reads and writes Ogg files, letting you manipulate Ogg pages and packets.
+ * - The system module provides a few generic tools for interating with the system, like file
+ *   mappings and the per-thread output streams. Its base64 codec lives in base64.cc.
+ * - The ogg module reads and writes Ogg files, letting you manipulate Ogg pages and packets. The
+ *   page CRC is computed in crc.cc, and the integrity check of --verify is in verify.cc.
  * - The opus module parses the contents of Ogg packets according to the Opus specifications.
+ * - The catalog module records the tags of the files already read, to skip them next time.
  * - The cli module implements the main logic of the program.
  * - The opustags module contains the main function, which is a simple wrapper around cli.
  *
- * Each module is implemented in its eponymous .cc file. Their interfaces are all defined and
- * documented together in this header file. Look into the .cc files for implementation-specific
- * details.
+ * Each module is implemented in its eponymous .cc file, except for the extra files mentioned
+ * above. Their interfaces are all defined and documented together in this header file. Look into
+ * the .cc files for implementation-specific details.
  *
  * To understand how this program works, you need to know what an Ogg files is made of, in
  * particular the streams, pages, and packets. You hardly need any knowledge of the actual Opus
@@ -29,11 +32,17 @@
 #include <iconv.h>
 #include <ogg/ogg.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include <functional>
+#include <initializer_list>
+#include <iterator>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -53,6 +62,8 @@
 #define le32toh(x) OSSwapLittleToHostInt32(x)
 #define htobe32(x) OSSwapHostToBigInt32(x)
 #define be32toh(x) OSSwapBigToHostInt32(x)
+#define htole64(x) OSSwapHostToLittleInt64(x)
+#define le64toh(x) OSSwapLittleToHostInt64(x)
 #endif
 
 using namespace std::literals;
@@ -92,6 +103,8 @@ enum class st {
 	cut_comment_length,
 	cut_comment_data,
 	invalid_size,
+	/* Catalog */
+	bad_catalog,
 	/* CLI */
 	bad_arguments,
 };
@@ -122,6 +135,16 @@ using byte_string_view = std::string_view;
  * \{
  */
 
+/**
+ * Streams to use instead of stdout and stderr for the messages printed by the current thread.
+ *
+ * They default to stdout and stderr, but the workers of parallel runs redirect them to memory
+ * streams, one per input file, so that the outputs of concurrent jobs can be printed in the order
+ * of the input files.
+ */
+extern thread_local FILE* thread_stdout;
+extern thread_local FILE* thread_stderr;
+
 /** fclose wrapper for std::unique_ptr’s deleter. */
 void close_file(FILE*);
 
@@ -163,6 +186,94 @@ private:
 	ot::file file;
 };
 
+/**
+ * Write the whole data block to the file descriptor at the specified offset, without changing its
+ * file position. Short writes are resumed until all the data is written.
+ */
+void write_at(int fd, byte_string_view data, off_t offset);
+
+/**
+ * Copy all the data of the input file descriptor from the specified offset up to its end, to the
+ * current position of the output file descriptor. The input must be seekable, and its file position
+ * is left unchanged.
+ *
+ * When available, copy_file_range or sendfile let the kernel copy the data without bouncing it
+ * through user space. Otherwise, the data is copied block by block with pread and write.
+ */
+void copy_file_tail(int input, off_t offset, int output);
+
+/**
+ * Make the output file a clone of the input file, sharing the same data blocks on copy-on-write file
+ * systems like Btrfs or XFS. Both must be regular files on the same file system.
+ *
+ * Return false if the system or the file system does not support cloning, in which case the output
+ * is left untouched.
+ */
+bool clone_file(int input, int output);
+
+/**
+ * Read-only memory mapping of a whole regular file. The mapping is released when the object is
+ * destroyed, and remains valid even after the file descriptor it was created from is closed.
+ */
+class file_mapping {
+public:
+	file_mapping() = default;
+	file_mapping(const file_mapping&) = delete;
+	file_mapping& operator=(const file_mapping&) = delete;
+	~file_mapping() { unmap(); }
+	/**
+	 * Map the file referred to by the file descriptor, and advise the kernel that it is going to
+	 * be read sequentially.
+	 *
+	 * Return false if the file cannot be mapped, for example because it is a pipe or it is empty,
+	 * in which case the caller is expected to fall back on regular reads.
+	 */
+	bool map(int fd);
+	/** Release the mapping, if any. */
+	void unmap();
+	/** Get a view of the mapped content, which is empty when nothing is mapped. */
+	byte_string_view data() const { return {static_cast<const char*>(address), size}; }
+private:
+	void* address = nullptr;
+	size_t size = 0;
+};
+
+/**
+ * Whole content of a file, mapped in memory when it is a regular file, or read with
+ * #slurp_binary_file otherwise, like standard input. The content does not move as long as the
+ * object lives.
+ */
+class file_contents {
+public:
+	explicit file_contents(const char* filename);
+	byte_string_view data() const { return mapped ? mapping.data() : buffer; }
+private:
+	file_mapping mapping;
+	bool mapped = false;
+	byte_string buffer;
+};
+
+/**
+ * Walk the directory tree rooted at path, and call f with the path of every regular file found, in
+ * the lexicographic order of the file names within every directory.
+ *
+ * Symbolic links inside the tree are ignored unless follow_symlinks is true, in which case they are
+ * resolved, and directories already visited are skipped to avoid looping. The file types are taken
+ * from the directory entries whenever the file system provides them, which saves a stat call per
+ * file.
+ *
+ * Errors on subdirectories are reported as warnings and the walk goes on, but an error on the root
+ * directory is thrown.
+ */
+void walk_directory(const std::string& path, bool follow_symlinks,
+                    const std::function<void(const std::string&)>& f);
+
+/**
+ * Ask the kernel to start reading the first bytes of the file at path into the page cache, without
+ * waiting for the data. Any error is ignored since this is only a hint.
+ */
+void prefetch_file(const char* path, off_t length);
+
 /** Read a whole file into memory and return the read content. */
 byte_string slurp_binary_file(const char* filename);
 
@@ -190,9 +301,52 @@ void run_editor(std::string_view editor, std::string_view path);
  */
 timespec get_file_timestamp(const char* path);
 
+/** Return the mtime of a file from its stat structure. */
+timespec get_file_timestamp(const struct stat& info);
+
 std::u8string encode_base64(byte_string_view src);
+/** Encode src into out, which must hold 4 characters for every 3 bytes of src, rounded up. */
+void encode_base64(byte_string_view src, char8_t* out);
 byte_string decode_base64(std::u8string_view src);
 
+/**
+ * Set of kernels processing whole groups of 3 bytes and 4 base64 characters, on which the base64
+ * functions are built. There are several implementations depending on the CPU features, and only
+ * the tests and benchmarks should need to use them directly.
+ */
+struct base64_codec {
+	const char* name;
+	/** Encode groups × 3 bytes into groups × 4 characters. */
+	void (*encode)(const unsigned char* in, size_t groups, char8_t* out);
+	/** Decode groups × 4 valid base64 characters into groups × 3 bytes. */
+	void (*decode)(const char8_t* in, size_t groups, unsigned char* out);
+	/** Tell whether the characters all belong to the base64 alphabet, excluding the padding. */
+	bool (*validate)(const char8_t* in, size_t size);
+};
+
+/**
+ * List the codecs supported by the CPU, from the slowest to the fastest. The first one is the
+ * portable reference implementation, and the last one is the one the base64 functions use.
+ */
+std::vector<const base64_codec*> base64_codecs();
+
+/**
+ * Random access to the bytes of a base64 string, decoded on demand, for data too large to be
+ * decoded at once. The string is validated on construction, so reading never fails.
+ */
+class base64_view {
+public:
+	explicit base64_view(std::u8string_view src);
+	/** Size of the decoded data. */
+	size_t size() const { return decoded_size; }
+	/** Decode length bytes starting at the given offset of the decoded data into out. */
+	void read(size_t offset, size_t length, char* out) const;
+private:
+	/** The base64 string, without its padding. */
+	std::u8string_view src;
+	size_t decoded_size;
+};
+
 /** \} */
 
 /***********************************************************************************************//**
@@ -223,7 +377,66 @@ struct ogg_logical_stream : ogg_stream_state {
 bool is_opus_stream(const ogg_page& identification_header);
 
 /**
- * Ogg reader, combining a FILE input, an ogg_sync_state reading the pages.
+ * Tell whether the data, read from the beginning of a file, looks like the identification header
+ * page of an Opus stream according to #is_opus_stream. The CRC is not checked, and the data may end
+ * right after the OpusHead signature. When the file starts with the beginning of stream pages of
+ * other multiplexed streams, like a Skeleton track, they are skipped.
+ *
+ * This is meant to dismiss non-Opus files after reading only their first few bytes, without going
+ * through the Ogg reader.
+ */
+bool starts_as_opus_stream(byte_string_view data);
+
+/** Maximum size of an Ogg page: a full header followed by 255 segments of 255 bytes. */
+constexpr size_t max_page_size = 27 + 255 + 255 * 255;
+
+/** Outcome of #parse_page: the first problem found in the page, if any. */
+enum class page_check {
+	valid,
+	truncated_header,
+	missing_capture_pattern,
+	unsupported_version,
+	truncated_page,
+	checksum_mismatch,
+};
+
+/**
+ * Parse the Ogg page at the beginning of data, and point the fields of page inside data. This is
+ * the parser of page headers shared by the Ogg reader, the integrity check of #verify_stream, and
+ * the helpers looking for pages in raw data.
+ *
+ * The fixed header is checked first, then the page must fit in data, and finally its CRC must
+ * match, unless check_crc is false. Like libogg’s sync layer, the capture pattern is only checked
+ * once the 27 bytes of the fixed header are available. When only the body is truncated, the fields
+ * of the page are still set, with the body cut at the end of the data.
+ */
+page_check parse_page(byte_string_view data, ogg_page& page, bool check_crc = true);
+
+/** Describe a problem found by #parse_page, like "CRC mismatch". */
+const char* page_check_message(page_check check);
+
+/**
+ * Find the last page in the data read from the end of a file, which is expected to contain at least
+ * #max_page_size bytes, and return its serial number. The last page is identified by its capture
+ * pattern and its size, which must bring it exactly to the end of the data, and its CRC must match.
+ *
+ * Return nothing if no valid page ends there, which is notably the case of truncated files.
+ */
+std::optional<int> last_page_serialno(byte_string_view tail);
+
+/**
+ * Find the first Ogg capture pattern, "OggS", in the data at or after offset, like
+ * byte_string_view::find but comparing 16 or 32 positions at once with SIMD instructions when the
+ * CPU supports them. Since the pattern starts with a letter frequent in text and common enough in
+ * compressed data, a search for its first byte followed by a comparison stops too often.
+ *
+ * Return byte_string_view::npos if the pattern is not found.
+ */
+size_t find_capture_pattern(byte_string_view data, size_t offset = 0);
+
+/**
+ * Ogg reader, parsing the pages of a FILE input from a buffer of its own, or from a mapping of the
+ * file.
  *
  * Call #read_page repeatedly until it returns false to consume the stream, and use #page to check
  * its content.
@@ -233,14 +446,7 @@ struct ogg_reader {
 	 * Initialize the reader with the given input file handle. The caller is responsible for
 	 * keeping the file handle alive, and to close it.
 	 */
-	ogg_reader(FILE* input) : file(input) { ogg_sync_init(&sync); }
-	/**
-	 * Clear all the internal memory allocated by libogg for the sync and stream state. The
-	 * page and the packet are owned by these states, so nothing to do with them.
-	 *
-	 * The input file is not closed.
-	 */
-	~ogg_reader() { ogg_sync_clear(&sync); }
+	ogg_reader(FILE* input) : file(input) {}
 	/**
 	 * Read the next page from the input file. The result is made available in the #page field,
 	 * is owned by the Ogg reader, and is valid until the next call to #read_page.
@@ -248,20 +454,42 @@ struct ogg_reader {
 	 * Return true if a page was read, false on end of stream.
 	 */
 	bool next_page();
+	/**
+	 * Switch the reader to a memory mapping of the input file, if it is a regular file. It must be
+	 * called before reading any page.
+	 *
+	 * The pages are then parsed directly from the mapping instead of being copied into the
+	 * #buffer, and only their headers are copied into #header_buffer so that they can be modified
+	 * by #renumber_page. Pipes and other special files keep being read with stdio.
+	 *
+	 * Return true if the input was mapped.
+	 */
+	bool map_input();
 	/**
 	 * Read the single packet contained in the last page read, assuming it's a header page, and
 	 * call the function f on it. This function has no side effect, and calling it twice on the
 	 * same page will read the same packet again.
 	 *
-	 * It is currently limited to packets that fit on a single page, and should be later
-	 * extended to support packets spanning multiple pages.
+	 * When the packet spans several pages, the pages of the other multiplexed logical streams
+	 * found in-between are passed to the foreign function, if set, and skipped otherwise.
+	 */
+	void process_header_packet(const std::function<void(ogg_packet&)>& f,
+	                           const std::function<void(const ogg_page&)>& foreign = nullptr);
+	/**
+	 * Like #process_header_packet, but pass the packet to f piece by piece, as the page bodies
+	 * are read, instead of assembling it first. The memory used thus does not depend on the size
+	 * of the packet, which is only known once the last piece was passed.
+	 *
+	 * The page structure is checked as the pages are read, so f may receive the first pieces of a
+	 * packet that turns out to be invalid.
 	 */
-	void process_header_packet(const std::function<void(ogg_packet&)>& f);
+	void process_header_pages(const std::function<void(byte_string_view)>& f,
+	                          const std::function<void(const ogg_page&)>& foreign = nullptr);
 	/**
-	 * Current page from the sync state.
+	 * Current page, pointing inside the #buffer, or inside the #mapping.
 	 *
-	 * Its memory is managed by libogg, inside the sync state, and is valid until the next call
-	 * to ogg_sync_pageout, wrapped by #read_page.
+	 * It is valid until the next call to #next_page. For mapped inputs, the header lives in
+	 * #header_buffer and the body points inside the mapping.
 	 */
 	ogg_page page;
 	/**
@@ -269,6 +497,24 @@ struct ogg_reader {
 	 * streams. The first page number is 0. When no page has been read, its value is -1.
 	 */
 	long absolute_page_no = -1;
+	/**
+	 * Byte offset of the last read page in the input file. Since #next_page rejects unsynced
+	 * data, the pages are contiguous and this is simply the sum of the sizes of the previous
+	 * pages.
+	 */
+	off_t page_offset = 0;
+	/**
+	 * Number of bytes to read from the file the next time the #buffer runs out of data.
+	 *
+	 * It starts small enough to read the OpusHead page and a typical OpusTags page in one go
+	 * without reading much further, because in read-only mode we stop after the headers. It then
+	 * doubles after every read, up to #max_read_size, for the throughput of full-file passes.
+	 */
+	size_t read_size = 4096;
+	/** Upper bound for #read_size. */
+	static constexpr size_t max_read_size = 65536;
+	/** Total number of bytes read from the input file so far. */
+	off_t bytes_read = 0;
 	/**
 	 * The file is our source of binary data. It is not integrated to libogg, so we need to
 	 * handle it ourselves.
@@ -277,13 +523,36 @@ struct ogg_reader {
 	 */
 	FILE* file;
 	/**
-	 * The sync layer gets binary data and yields a sequence of pages.
+	 * Path to the input file, as specified by the user, "-" being stdin.
+	 */
+	std::string path;
+	/**
+	 * Data read from the file, from which the pages are parsed in place. Only the unfinished
+	 * page at its end, if any, is moved back to its start before reading more, so that the data
+	 * of a page is never copied otherwise. It is allocated on the first read.
 	 *
-	 * A page contains packets that we can extract using the #stream state, but we only do that
-	 * for the headers. Once we got the OpusHead and OpusTags packets, all the following pages
-	 * are simply forwarded to the Ogg writer.
+	 * We only extract the packets of the headers. Once we got the OpusHead and OpusTags packets,
+	 * all the following pages are simply forwarded to the Ogg writer.
+	 */
+	std::unique_ptr<unsigned char[]> buffer;
+	/** Capacity of the #buffer, enough for an unfinished page followed by a full read. */
+	static constexpr size_t buffer_size = max_page_size + max_read_size;
+	/** Offset of the next page in the #buffer. */
+	size_t buffer_start = 0;
+	/** Offset of the end of the data in the #buffer. */
+	size_t buffer_end = 0;
+	/**
+	 * Memory mapping of the input file, set by #map_input. When it is empty, the pages are read
+	 * through the #buffer instead.
 	 */
-	ogg_sync_state sync;
+	file_mapping mapping;
+	/** Offset of the next page in the #mapping. */
+	size_t mapping_offset = 0;
+	/**
+	 * Copy of the header of the current page when reading from the #mapping. Ogg page headers
+	 * are at most 27 bytes long, plus 255 lacing values.
+	 */
+	unsigned char header_buffer[27 + 255];
 };
 
 /**
@@ -291,22 +560,43 @@ struct ogg_reader {
  *
  * Its packet writing facility is limited to writing single-page header packets, because that's all
  * we need for opustags.
+ *
+ * The pages are gathered into a batch buffer that is written to the file in one go when full, so
+ * that forwarding the hundreds of thousands of pages of a long file doesn't take as many write
+ * calls, each of them locking the file and often making a system call.
  */
 struct ogg_writer {
 	/**
 	 * Initialize the writer with the given output file handle. The caller is responsible for
 	 * keeping the file handle alive, and to close it.
+	 *
+	 * The pages are written by batches of up to batch_size bytes. Pages larger than that are
+	 * written directly.
 	 */
-	explicit ogg_writer(FILE* output) : file(output) {}
+	explicit ogg_writer(FILE* output, size_t batch_size = default_batch_size)
+		: file(output), batch_size(batch_size) {}
+	ogg_writer(const ogg_writer&) = delete;
+	ogg_writer& operator=(const ogg_writer&) = delete;
 	/**
-	 * Write a whole Ogg page into the output stream.
+	 * Write the pages left in the batch, ignoring errors since the output is usually discarded
+	 * when the writer is destroyed without having been flushed. Call #flush to check them.
+	 */
+	~ogg_writer();
+	/**
+	 * Write a whole Ogg page into the output stream. The page is copied into the batch, and only
+	 * reaches the file once the batch is full, or when #flush is called.
 	 *
 	 * This is a basic I/O operation and does not even require libogg, or the stream.
 	 */
 	void write_page(const ogg_page& page);
+	/**
+	 * Write the pages of the batch to the output file, and flush the file. This must be done
+	 * before the output file is used by anything else than the writer, or closed.
+	 */
+	void flush();
 	/**
 	 * Write a header packet and flush the page. Header packets are always placed alone on their
-	 * pages.
+	 * pages, paginated by #paginate_header_packet.
 	 */
 	void write_header_packet(int serialno, int pageno, ogg_packet& packet);
 	/**
@@ -319,12 +609,44 @@ struct ogg_writer {
 	 */
 	std::optional<std::string> path;
 	/**
-	 * Custom counter for the sequential page number to be written. It allows us to detect
-	 * ogg_page_pageno mismatches and renumber the pages if needed.
+	 * Custom counters for the sequential page number to be written, for every logical stream by
+	 * serial number. They allow us to detect ogg_page_pageno mismatches and renumber the pages if
+	 * needed.
+	 */
+	std::map<int, long> next_page_no;
+	/**
+	 * Batch size used by default, large enough for the cost of the writes to vanish. Larger
+	 * batches are no faster, as they start falling out of the CPU caches.
 	 */
-	long next_page_no = 0;
+	static constexpr size_t default_batch_size = 1 << 20;
+	/** Capacity of the #batch. */
+	size_t batch_size;
+	/** Pages written but not yet passed to the file, allocated on the first page. */
+	std::unique_ptr<unsigned char[]> batch;
+	/** Number of bytes in the #batch. */
+	size_t batch_fill = 0;
 };
 
+/**
+ * Split a header packet into pages numbered from pageno, exactly like libogg would when the packet
+ * is flushed alone, and pass them in order to f. The bodies of the pages point directly into the
+ * packet, which is thus never copied.
+ */
+void paginate_header_packet(int serialno, int pageno, const ogg_packet& packet,
+                            const std::function<void(const ogg_page&)>& f);
+
+/** Number of pages and total size of the pages of a header packet. */
+struct header_pages {
+	long count;
+	size_t size;
+};
+
+/**
+ * Compute the layout of the pages #paginate_header_packet makes of a packet of the given size,
+ * without rendering them.
+ */
+header_pages header_pages_layout(size_t packet_size);
+
 /**
  * Ogg packet with dynamically allocated data.
  *
@@ -342,9 +664,49 @@ private:
 	std::unique_ptr<unsigned char[]> data;
 };
 
-/** Update the Ogg pageno field in the given page. The CRC is recomputed if needed. */
+/**
+ * Update the Ogg pageno field in the given page. The CRC is patched with #ogg_crc32_zeros, without
+ * reading the page body.
+ */
 void renumber_page(ogg_page& page, long new_pageno);
 
+/**
+ * Update the CRC-32 of an Ogg page, like ogg_page_checksum_set but with a faster implementation
+ * chosen according to the CPU. The current value of the CRC field is ignored.
+ */
+void set_page_checksum(ogg_page& page);
+
+/** Tell whether the CRC field of the page matches its content. */
+bool check_page_checksum(const ogg_page& page);
+
+/**
+ * Continue the computation of an Ogg CRC-32 over the given data. Start with 0 for a fresh
+ * checksum.
+ */
+uint32_t ogg_crc32(uint32_t crc, byte_string_view data);
+
+/**
+ * Continue the computation of an Ogg CRC-32 as if length null bytes were appended, in O(log length)
+ * time.
+ *
+ * Since the Ogg CRC is linear, this lets us patch the CRC of a page whose bytes changed without
+ * reading the rest of the page: the CRC of the XOR difference, extended by the number of bytes
+ * following it, is the XOR difference of the CRCs.
+ */
+uint32_t ogg_crc32_zeros(uint32_t crc, uint64_t length);
+
+/**
+ * Check the integrity of a whole Ogg file: the CRC of every page, the page sequence numbers, the
+ * continuation of packets across pages, the monotonicity of the granule positions, and the
+ * beginning and end of stream flags of every logical stream. Nothing may come between the pages.
+ *
+ * Large files are split into ranges of range_size bytes, checked on up to the given number of
+ * threads.
+ *
+ * Throw a #status describing the first problem found in the file.
+ */
+void verify_stream(byte_string_view data, unsigned threads, size_t range_size = 64 << 20);
+
 /** \} */
 
 /***********************************************************************************************//**
@@ -352,6 +714,113 @@ void renumber_page(ogg_page& page, long new_pageno);
  * \{
  */
 
+struct opus_tags;
+
+/**
+ * List of comments stored contiguously, as they are laid out in an OpusTags packet: every comment
+ * is preceded by its 32-bit little-endian length, and they follow each other in a byte buffer. An
+ * index of offsets and lengths into the buffer provides random access to the comments.
+ *
+ * The comments of a parsed packet may be borrowed from the packet itself, in which case the packet
+ * must outlive the list, or until #detach is called. Editing the list never copies these comments:
+ * new comments are appended to an arena owned by the list, and removing comments only drops them
+ * from the index. When rendered, the comments found contiguously in the packet or in the arena are
+ * copied in one go, so an untouched list is copied in a single pass.
+ *
+ * Since the list may own a copy of the packet data, it can be moved but not copied implicitly.
+ *
+ * The comments are exposed as string views, which are invalidated by any modification of the list.
+ */
+class comment_list {
+	/** Where the content of a comment is stored. */
+	enum class origin { arena, packet, deferred };
+	/**
+	 * Position of a comment in the packet or the arena, after its length prefix, or index of a
+	 * deferred comment.
+	 */
+	struct entry {
+		size_t offset;
+		size_t length;
+		origin from;
+	};
+public:
+	/**
+	 * Comment whose content is only produced when the list is rendered, for large comments like
+	 * covers that would otherwise be copied several times. write must write exactly size bytes.
+	 */
+	struct deferred_comment {
+		size_t size;
+		std::function<void(char* out)> write;
+	};
+
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::u8string_view;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = std::u8string_view;
+		iterator() = default;
+		std::u8string_view operator*() const { return list->text(*it); }
+		iterator& operator++() { ++it; return *this; }
+		iterator operator++(int) { iterator copy = *this; ++it; return copy; }
+		bool operator==(const iterator& other) const { return it == other.it; }
+	private:
+		friend class comment_list;
+		iterator(const comment_list* list, std::vector<entry>::const_iterator it)
+			: list(list), it(it) {}
+		const comment_list* list = nullptr;
+		std::vector<entry>::const_iterator it;
+	};
+
+	comment_list() = default;
+	comment_list(std::initializer_list<std::u8string_view> comments);
+	/** Adapter for the comments read from the user, or by code that works on lists. */
+	comment_list(const std::list<std::u8string>& comments);
+	comment_list(comment_list&&) = default;
+	comment_list& operator=(comment_list&&) = default;
+	operator std::list<std::u8string>() const;
+
+	iterator begin() const { return {this, entries.begin()}; }
+	iterator end() const { return {this, entries.end()}; }
+	size_t size() const { return entries.size(); }
+	bool empty() const { return entries.empty(); }
+	std::u8string_view operator[](size_t i) const { return text(entries[i]); }
+
+	/** Append a comment at the end of the list. Throw if it is longer than 4 GiB. */
+	void push_back(std::u8string_view comment);
+	/**
+	 * Append a comment that will be written directly into the rendered packet. Accessing it as
+	 * a string makes the list write it in a buffer of its own, which is kept.
+	 */
+	void push_back(deferred_comment comment);
+	void clear();
+	/** Remove the comments matching the predicate, compacting the arena in a single pass. */
+	void remove_if(const std::function<bool(std::u8string_view)>& predicate);
+	/** Copy the borrowed comments into the arena, so that the list no longer refers to the packet. */
+	void detach();
+	/** Size of the comments serialized as in an OpusTags packet, after the comment count. */
+	size_t rendered_size() const { return total_size; }
+	/** Serialize the comments into out, which must hold #rendered_size bytes. */
+	void render(char* out) const;
+
+private:
+	friend opus_tags parse_tags_view(byte_string_view packet);
+	friend class opus_tags_parser;
+	std::u8string_view text(const entry& e) const;
+	/** A deferred comment, and its content once accessed as a string. */
+	struct deferred_entry {
+		deferred_comment comment;
+		mutable std::unique_ptr<char[]> text;
+	};
+	/** The comments of the parsed packet, if they were not copied. */
+	byte_string_view borrowed;
+	byte_string arena;
+	std::vector<deferred_entry> deferred;
+	std::vector<entry> entries;
+	size_t total_size = 0;
+};
+
 /**
  * Faithfully represent *all* the data in an OpusTags packet, exactly as they will be written in the
  * final stream, disregarding the current system locale or anything else.
@@ -373,17 +842,16 @@ struct opus_tags {
 	 * can be any valid UTF-8 string. The specification is not too clear for Opus, but let's
 	 * assume it's the same.
 	 */
-	std::list<std::u8string> comments;
+	comment_list comments;
 	/**
 	 * According to RFC 7845:
 	 * > Immediately following the user comment list, the comment header MAY contain
 	 * > zero-padding or other binary data that is not specified here.
 	 *
-	 * The first byte is supposed to indicate whether this data should be kept or not, but let's
-	 * assume it's here for a reason and always keep it. Better safe than sorry.
-	 *
-	 * In the future, we could add options to manipulate this data: view it, edit it, truncate
-	 * it if it's marked as padding, truncate it unconditionally.
+	 * The least significant bit of its first byte tells whether it must be kept. When it is set,
+	 * the data is kept as is. When it is clear, the data is mere padding, which #resize_padding
+	 * may trim or regrow with zeros to absorb the size changes of the comments, and which
+	 * --padding replaces. In the future, we could add options to view or edit it.
 	 */
 	byte_string extra_data;
 };
@@ -393,11 +861,79 @@ struct opus_tags {
  */
 opus_tags parse_tags(const ogg_packet& packet);
 
+/**
+ * Parse the OpusTags packet like #parse_tags, but without copying the comments: their length
+ * structure is validated and indexed, and the comments are read from the packet when accessed.
+ * Listing the vendor or a few fields thus costs time proportional to the number of comments rather
+ * than their size.
+ *
+ * The packet must outlive the returned tags, unless #comment_list::detach is called. Temporary
+ * strings are rejected for that reason.
+ */
+opus_tags parse_tags_view(byte_string_view packet);
+opus_tags parse_tags_view(byte_string&& packet) = delete;
+
+/**
+ * Incremental OpusTags parser, fed with the packet piece by piece, typically the page bodies
+ * passed by #ogg_reader::process_header_pages.
+ *
+ * Every comment is passed to the comment function as soon as it is complete, and then forgotten.
+ * The comments found entirely within a piece are passed straight from it, and only those that span
+ * several pieces are assembled in a buffer. The memory used is thus bounded by the largest comment
+ * rather than by the size of the packet. Without a comment function, the comments are appended to
+ * the comment list of the tags, like #parse_tags(const ogg_packet&) would, so that the list ends up
+ * holding a copy of every comment and the memory used is that of the whole packet.
+ *
+ * The vendor string is set in the tags before the first comment is passed, and the extra data once
+ * the last comment was passed.
+ */
+class opus_tags_parser {
+public:
+	explicit opus_tags_parser(opus_tags& tags,
+	                          std::function<void(std::u8string_view)> on_comment = nullptr);
+	void feed(byte_string_view piece);
+	/**
+	 * Signal the end of the packet. Throw the same errors as #parse_tags if the packet was cut
+	 * before the end of the comments.
+	 */
+	void finish();
+	/** Total size of the pieces fed to the parser. */
+	size_t size() const { return fed; }
+private:
+	/** The field of the packet being read. */
+	enum class field { magic, vendor_length, vendor, count, comment_length, comment, extra_data };
+	void read(byte_string_view data);
+	opus_tags& tags;
+	std::function<void(std::u8string_view)> on_comment;
+	field expected = field::magic;
+	/** Size of the expected field. */
+	size_t needed = 8;
+	/** Beginning of the expected field, when it spans several pieces. */
+	byte_string buffer;
+	uint32_t remaining_comments = 0;
+	size_t fed = 0;
+};
+
 /**
  * Serialize an #opus_tags object into an OpusTags Ogg packet.
  */
 dynamic_ogg_packet render_tags(const opus_tags& tags);
 
+/** Compute the size of the OpusTags packet #render_tags would generate. */
+size_t rendered_size(const opus_tags& tags);
+
+/**
+ * Grow or shrink the padding at the end of the OpusTags packet so that its rendered packet is
+ * exactly packet_size bytes long.
+ *
+ * According to RFC 7845, the extra data is padding that may be truncated when the least
+ * significant bit of its first byte is 0. Only existing padding is resized: when the extra data is
+ * empty or must be preserved, the tags are left untouched unless they already have the right size.
+ *
+ * Return true if the rendered packet now has the requested size.
+ */
+bool resize_padding(opus_tags& tags, size_t packet_size);
+
 /**
  * Extracted data from the METADATA_BLOCK_PICTURE tag. See
  * <https://xiph.org/flac/format.html#metadata_block_picture> for the full specifications.
@@ -427,12 +963,147 @@ struct picture {
 /** Extract the first picture embedded in the tags, regardless of its type. */
 std::optional<picture> extract_cover(const opus_tags& tags);
 
+/**
+ * Picture embedded in a METADATA_BLOCK_PICTURE tag, decoded on demand from the base64 value of the
+ * tag. Only the fields preceding the picture data are decoded on construction, which validates the
+ * picture block, so that the picture data can then be streamed in bounded memory.
+ */
+struct cover_view {
+	explicit cover_view(std::u8string_view value);
+	/**
+	 * Decode the picture data and pass it to the sink by chunks of at most chunk_size bytes.
+	 */
+	void read_picture(const std::function<void(byte_string_view)>& sink,
+	                  size_t chunk_size = 64 << 10) const;
+	base64_view block;
+	byte_string mime_type;
+	size_t picture_offset;
+	size_t picture_size;
+};
+
+/**
+ * Find the first picture embedded in the tags like #extract_cover, without decoding its data.
+ * The tags must outlive the returned view.
+ */
+std::optional<cover_view> find_cover(const opus_tags& tags);
+
 /**
  * Return a METADATA_BLOCK_PICTURE tag defining the front cover art to the given picture data (JPEG,
  * PNG). The MIME type is deduced from the magic number.
  */
 std::u8string make_cover(byte_string_view picture_data);
 
+/**
+ * Build the same tag as #make_cover for the content of a file, but only encode it when the tags
+ * are rendered, directly into the OpusTags packet. The comment keeps the file alive.
+ */
+comment_list::deferred_comment make_cover(std::shared_ptr<const file_contents> picture);
+
+/**
+ * Predicate on a single comment, built from a selector that is either a field name or a
+ * NAME=VALUE pair. The field name is case-insensitive, and the value is compared byte by byte.
+ *
+ * A field name alone matches the comments of that field that have a non-empty value. With a value,
+ * the comment must have exactly that value, or start with it when prefix is true.
+ */
+struct comment_selector {
+	comment_selector(std::u8string_view selector, bool prefix = false);
+	bool matches(std::u8string_view comment) const;
+	std::u8string name;
+	std::optional<std::u8string> value;
+	bool prefix;
+};
+
+/**
+ * Tell whether the OpusTags packet contains, for every selector, at least one comment matching it.
+ *
+ * The comments are tested directly in the packet, without copying them, and the scan stops as soon
+ * as every selector is satisfied. Comments are only compared as far as the selectors need, which
+ * makes the large cover arts almost free to skip.
+ */
+bool match_tags(byte_string_view packet, const std::vector<comment_selector>& selectors);
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup catalog Catalog
+ * \{
+ */
+
+/**
+ * State of a file as recorded in the catalog. Modifying a file changes its size or its
+ * modification time, which makes its catalog entry stale.
+ */
+struct catalog_key {
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	timespec mtime;
+};
+
+/**
+ * Build the catalog key of the file at path with a single stat call. Return nothing if the file
+ * cannot be stat’d, or if it is not a regular file.
+ */
+std::optional<catalog_key> get_catalog_key(const char* path);
+
+/**
+ * A catalog is a persistent cache of the OpusTags packets of files, so that listing a large library
+ * only needs to parse the files that changed since the last run. The other files are only stat’d.
+ *
+ * The entries are indexed by device and inode, and record the size and modification time of the
+ * file when its packet was read. A lookup only succeeds when these still match.
+ *
+ * The cover arts, which make most of the size of the packets, are not stored whole: their
+ * METADATA_BLOCK_PICTURE comments are cut after the fields of the picture block, and the entry is
+ * marked as summarized. Such entries can only serve the listings that don’t need the pictures.
+ *
+ * The catalog is stored in a compact binary file: the magic signature "OTCATLG1", followed by the
+ * entries, each made of the device, inode, size and mtime seconds as 64-bit integers, the mtime
+ * nanoseconds, the packet size and the flags as 32-bit integers, all little-endian, and finally the
+ * packet. The only flag is 1 for summarized entries.
+ *
+ * All the member functions are thread-safe.
+ */
+class catalog {
+public:
+	/** Load the entries from the catalog file at path. A missing file is an empty catalog. */
+	void load(const char* path);
+	/**
+	 * Write the catalog to the file at path, if it was modified since it was loaded. The
+	 * previous file is replaced atomically.
+	 */
+	void save(const char* path);
+	/**
+	 * Drop the entries of the files that were neither found nor stored since the catalog was
+	 * loaded, so that the catalog stops covering the files that left the library.
+	 */
+	void prune();
+	/**
+	 * Return the OpusTags packet stored for the file, unless the entry is stale, or unless its
+	 * covers were summarized and with_covers is true.
+	 */
+	std::optional<byte_string> find(const catalog_key& key, bool with_covers = true) const;
+	/** Tell whether the catalog has an up-to-date entry for the file, like #find. */
+	bool contains(const catalog_key& key, bool with_covers = true) const;
+	/** Store the OpusTags packet of the file, replacing its previous entry. */
+	void store(const catalog_key& key, byte_string_view packet);
+private:
+	struct entry {
+		off_t size;
+		timespec mtime;
+		byte_string packet;
+		bool summarized;
+		/** Whether the entry was used or stored since the catalog was loaded. */
+		mutable bool seen;
+	};
+	/** Return the entry of the file if it is up to date, and mark it as seen. */
+	const entry* lookup(const catalog_key& key) const;
+	std::map<std::pair<dev_t, ino_t>, entry> entries;
+	bool modified = false;
+	mutable std::mutex mutex;
+};
+
 /** \} */
 
 /***********************************************************************************************//**
@@ -453,8 +1124,8 @@ struct options {
 	/**
 	 * Paths to the input files. The special string "-" means stdin.
 	 *
-	 * At least one input file must be given. If `--in-place` is used,
-	 * more than one may be given.
+	 * At least one input file must be given. If `--output` or `--edit` is used, exactly one
+	 * must be given.
 	 */
 	std::vector<std::string> paths_in;
 	/**
@@ -512,6 +1183,13 @@ struct options {
 	 * Options: --add, --set, --set-all
 	 */
 	std::list<std::u8string> to_add;
+	/**
+	 * Cover art tag to add after #to_add. The picture is read once for all the files, and is only
+	 * encoded when the OpusTags packet is rendered.
+	 *
+	 * Option: --set-cover
+	 */
+	std::optional<comment_list::deferred_comment> cover_to_add;
 	/**
 	 * If set, the input file’s cover art is exported to the specified file. - for stdout. Does
 	 * not overwrite the file if it already exists unless -y is specified. Does nothing if the
@@ -546,6 +1224,87 @@ struct options {
 	 * processing of multi-line tags with other tools that support null-terminated lines.
 	 */
 	char tag_delimiter = '\n';
+	/**
+	 * Amount of zero padding to leave at the end of the OpusTags packet, replacing any existing
+	 * padding. Extra data that is not padding is preserved.
+	 *
+	 * When unset, the extra data is preserved as is, except that existing padding is resized
+	 * to absorb the size changes of the comments whenever this lets the comment header keep its
+	 * exact size, so that the following pages need not be moved.
+	 *
+	 * Option: --padding
+	 */
+	std::optional<size_t> padding;
+	/**
+	 * Number of files to process concurrently. The outputs and errors of every file are still
+	 * reported in the order of the input files.
+	 *
+	 * Option: --jobs
+	 */
+	unsigned jobs = 1;
+	/**
+	 * Process the files under the directories specified as input files, recursively. The files
+	 * found in directories are processed only if their first bytes look like an Opus stream, and
+	 * the other files are skipped silently.
+	 *
+	 * Option: --recursive
+	 */
+	bool recursive = false;
+	/**
+	 * Follow the symbolic links found inside the directories walked by --recursive. The input
+	 * paths themselves are always followed.
+	 *
+	 * Option: --follow-symlinks
+	 */
+	bool follow_symlinks = false;
+	/**
+	 * Path to the catalog file caching the tags of the listed files, so that only the files
+	 * that changed since the previous run are read. Only applicable in read-only mode.
+	 *
+	 * Option: --catalog
+	 */
+	std::optional<std::string> catalog_path;
+	/**
+	 * Drop the entries of the catalog of the files that were not listed, when saving it.
+	 *
+	 * Option: --prune-catalog
+	 */
+	bool prune_catalog = false;
+	/**
+	 * Print the tags as one JSON object per line, instead of the text format of #print_comments.
+	 * See #print_json.
+	 *
+	 * Option: --json
+	 */
+	bool json = false;
+	/**
+	 * Prefix the lines printed in read-only mode with the path of the file they come from, like
+	 * grep -H. It is enabled automatically when several files may be listed.
+	 *
+	 * Option: --with-filename
+	 */
+	bool with_filename = false;
+	/**
+	 * In read-only mode, print the path of the files whose tags match all these selectors,
+	 * instead of their tags. See #match_tags.
+	 *
+	 * Options: --match, --match-prefix
+	 */
+	std::vector<comment_selector> matches;
+	/**
+	 * Check the integrity of the input files instead of printing their tags. See
+	 * #verify_stream.
+	 *
+	 * Option: --verify
+	 */
+	bool verify = false;
+	/**
+	 * Index of the link to list or edit in a chained Ogg file, starting from 1, or 0 for all of
+	 * them. When unset, only the first link is listed or edited, like for a single stream.
+	 *
+	 * Option: --link
+	 */
+	std::optional<unsigned> link;
 };
 
 /**
@@ -563,7 +1322,32 @@ options parse_options(int argc, char** argv, FILE* comments);
  *
  * The output generated is meant to be parseable by #ot::read_comments.
  */
-void print_comments(const std::list<std::u8string>& comments, FILE* output, const options& opt);
+void print_comments(const comment_list& comments, FILE* output, const options& opt);
+
+/**
+ * Print the tags of a file as a single-line JSON object, which is then suitable for the NDJSON
+ * format when several files are listed. The object is made of:
+ *
+ * - `path`: the path of the file, as given,
+ * - `vendor`: the vendor string,
+ * - `comments`: an array of `[name, value]` pairs, value being null for malformed comments that
+ *   don’t contain an equal sign,
+ * - `extra_data`: the size in bytes of the binary data after the comments,
+ * - `bytes_read`: the number of bytes read from the file to get the tags, 0 when they were not
+ *   read from the file,
+ * - `cover`: null if the tags contain no cover art, or an object with the `mime_type` and `size`
+ *   of the first picture.
+ *
+ * The strings are written as UTF-8 regardless of the system locale. Bytes that are not valid UTF-8
+ * are escaped as the lone surrogates \udc80 to \udcff, like Python’s surrogateescape error
+ * handler, so that binary data is preserved without being mistaken for actual characters.
+ *
+ * When listing the links of a chained file with --link, the CLI also adds a `link` field after
+ * the path, with the index of the link starting from 1.
+ *
+ * The object is built in memory then written with a single call.
+ */
+void print_json(std::string_view path, const opus_tags& tags, off_t bytes_read, FILE* output);
 
 /**
  * Parse the comments outputted by #ot::print_comments. Unless raw is true, the comments are
@@ -573,8 +1357,9 @@ std::list<std::u8string> read_comments(FILE* input, const options& opt);
 
 /**
  * Remove all comments matching the specified selector, which may either be a field name or a
- * NAME=VALUE pair. The field name is case-insensitive.
+ * NAME=VALUE pair. The field name is case-insensitive. See #comment_selector.
  */
+void delete_comments(comment_list& comments, const std::u8string& selector);
 void delete_comments(std::list<std::u8string>& comments, const std::u8string& selector);
 
 /**
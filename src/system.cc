@@ -11,13 +11,30 @@
 
 #include <opustags.h>
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fstream>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
+#include <set>
+
+#ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#endif
+
+thread_local FILE* ot::thread_stdout = stdout;
+thread_local FILE* ot::thread_stderr = stderr;
 
 void ot::close_file(FILE* file)
 {
@@ -44,8 +61,12 @@ static mode_t get_umask()
 {
 	// libc doesn’t seem to provide a way to get umask without changing it, so we need this workaround.
 	// https://www.gnu.org/software/libc/manual/html_node/Setting-Permissions.html
-	mode_t mask = umask(0);
-	umask(mask);
+	// The workaround is not thread-safe, so we do it only once, in a thread-safe initialization.
+	static const mode_t mask = [] {
+		mode_t mask = umask(0);
+		umask(mask);
+		return mask;
+	}();
 	return mask;
 }
 
@@ -66,11 +87,11 @@ static void copy_permissions(const char* source, const char* dest)
 	} else if (errno == ENOENT) {
 		target_mode = 0666 & ~get_umask();
 	} else {
-		fprintf(stderr, "warning: Could not read mode of %s: %s\n", source, strerror(errno));
+		fprintf(ot::thread_stderr, "warning: Could not read mode of %s: %s\n", source, strerror(errno));
 		return;
 	}
 	if (chmod(dest, target_mode) == -1)
-		fprintf(stderr, "warning: Could not set mode of %s: %s\n", dest, strerror(errno));
+		fprintf(ot::thread_stderr, "warning: Could not set mode of %s: %s\n", dest, strerror(errno));
 }
 
 void ot::partial_file::commit()
@@ -93,6 +114,229 @@ void ot::partial_file::abort()
 	remove(temporary_name.c_str());
 }
 
+void ot::write_at(int fd, byte_string_view data, off_t offset)
+{
+	while (!data.empty()) {
+		ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written == -1)
+			throw status {st::standard_error, "pwrite error: "s + strerror(errno)};
+		data.remove_prefix(written);
+		offset += written;
+	}
+}
+
+/**
+ * Tell whether a kernel-side copy failed because the kernel or the file systems do not support it,
+ * in which case we can safely fall back to a slower method.
+ */
+static bool is_unsupported_copy(int error)
+{
+	return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP ||
+	       error == EBADF;
+}
+
+void ot::copy_file_tail(int input, off_t offset, int output)
+{
+	// Copy at most 1 GiB at once, which is as good as infinity but safely fits in a ssize_t.
+	constexpr size_t max_chunk = 1 << 30;
+#ifdef HAVE_COPY_FILE_RANGE
+	for (;;) {
+		ssize_t copied = copy_file_range(input, &offset, output, nullptr, max_chunk, 0);
+		if (copied == 0)
+			return;
+		if (copied > 0 || errno == EINTR)
+			continue;
+		if (is_unsupported_copy(errno))
+			break;
+		throw status {st::standard_error, "copy_file_range error: "s + strerror(errno)};
+	}
+#endif
+#ifdef HAVE_SENDFILE
+	for (;;) {
+		ssize_t copied = sendfile(output, input, &offset, max_chunk);
+		if (copied == 0)
+			return;
+		if (copied > 0 || errno == EINTR)
+			continue;
+		if (is_unsupported_copy(errno))
+			break;
+		throw status {st::standard_error, "sendfile error: "s + strerror(errno)};
+	}
+#endif
+	// The kernel copies may have failed after copying some data, but they updated the offset.
+	char buffer[65536];
+	for (;;) {
+		ssize_t read_len = pread(input, buffer, sizeof(buffer), offset);
+		if (read_len == -1 && errno == EINTR)
+			continue;
+		if (read_len == -1)
+			throw status {st::standard_error, "pread error: "s + strerror(errno)};
+		if (read_len == 0)
+			return;
+		offset += read_len;
+		for (char* data = buffer; read_len > 0;) {
+			ssize_t written = write(output, data, read_len);
+			if (written == -1 && errno == EINTR)
+				continue;
+			if (written == -1)
+				throw status {st::standard_error, "write error: "s + strerror(errno)};
+			data += written;
+			read_len -= written;
+		}
+	}
+}
+
+bool ot::clone_file(int input, int output)
+{
+#ifdef FICLONE
+	return ioctl(output, FICLONE, input) == 0;
+#else
+	return false;
+#endif
+}
+
+bool ot::file_mapping::map(int fd)
+{
+	unmap();
+	struct stat info;
+	if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size <= 0)
+		return false;
+	if (static_cast<uintmax_t>(info.st_size) > SIZE_MAX)
+		return false;
+	void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapped == MAP_FAILED)
+		return false;
+	address = mapped;
+	size = info.st_size;
+	// The hint is only an optimization, so its failure is not an error.
+	madvise(address, size, MADV_SEQUENTIAL);
+	return true;
+}
+
+void ot::file_mapping::unmap()
+{
+	if (address == nullptr)
+		return;
+	munmap(address, size);
+	address = nullptr;
+	size = 0;
+}
+
+ot::file_contents::file_contents(const char* filename)
+{
+	if (strcmp(filename, "-") != 0) {
+		int fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			throw status {st::standard_error,
+			              "Could not open '"s + filename + "' for reading: " + strerror(errno)};
+		mapped = mapping.map(fd);
+		close(fd);
+		if (mapped)
+			return;
+	}
+	buffer = slurp_binary_file(filename);
+}
+
+/** closedir wrapper for std::unique_ptr’s deleter. */
+static void close_directory(DIR* dir)
+{
+	closedir(dir);
+}
+
+/** Identity of a directory, to detect the loops created by symbolic links. */
+using file_id = std::pair<dev_t, ino_t>;
+
+/**
+ * Recursive part of #ot::walk_directory. The directory is open at fd, which is owned by this
+ * function. The visited set is only maintained when following symbolic links.
+ */
+static void walk_directory_at(int fd, const std::string& path, bool follow_symlinks,
+                              std::set<file_id>& visited,
+                              const std::function<void(const std::string&)>& f)
+{
+	DIR* dir = fdopendir(fd);
+	if (dir == nullptr) {
+		close(fd);
+		throw ot::status {ot::st::standard_error,
+		                  "Could not open directory '" + path + "': " + strerror(errno)};
+	}
+	std::unique_ptr<DIR, decltype(&close_directory)> dir_guard(dir, &close_directory);
+
+	std::vector<std::pair<std::string, unsigned char>> entries;
+	errno = 0;
+	while (dirent* entry = readdir(dir)) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			entries.emplace_back(entry->d_name, entry->d_type);
+	}
+	if (errno != 0)
+		throw ot::status {ot::st::standard_error,
+		                  "Could not read directory '" + path + "': " + strerror(errno)};
+	std::sort(entries.begin(), entries.end());
+
+	std::string prefix = path.ends_with('/') ? path : path + '/';
+	for (auto& [name, type] : entries) {
+		std::string entry_path = prefix + name;
+		if (type == DT_UNKNOWN || (type == DT_LNK && follow_symlinks)) {
+			struct stat info;
+			int flags = follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+			if (fstatat(fd, name.c_str(), &info, flags) == -1) {
+				fprintf(ot::thread_stderr, "warning: Could not stat '%s': %s\n",
+				        entry_path.c_str(), strerror(errno));
+				continue;
+			}
+			type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if (type == DT_REG) {
+			f(entry_path);
+		} else if (type == DT_DIR) {
+			int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow_symlinks ? 0 : O_NOFOLLOW);
+			int subdir = openat(fd, name.c_str(), flags);
+			struct stat info;
+			try {
+				if (subdir == -1)
+					throw ot::status {ot::st::standard_error, "Could not open directory '" +
+					                  entry_path + "': " + strerror(errno)};
+				if (follow_symlinks && fstat(subdir, &info) == 0 &&
+				    !visited.emplace(info.st_dev, info.st_ino).second) {
+					close(subdir);
+					continue;
+				}
+				walk_directory_at(subdir, entry_path, follow_symlinks, visited, f);
+			} catch (const ot::status& rc) {
+				fprintf(ot::thread_stderr, "warning: %s\n", rc.message.c_str());
+			}
+		}
+	}
+}
+
+void ot::walk_directory(const std::string& path, bool follow_symlinks,
+                        const std::function<void(const std::string&)>& f)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		throw status {st::standard_error,
+		              "Could not open directory '" + path + "': " + strerror(errno)};
+	std::set<file_id> visited;
+	struct stat info;
+	if (follow_symlinks && fstat(fd, &info) == 0)
+		visited.emplace(info.st_dev, info.st_ino);
+	walk_directory_at(fd, path, follow_symlinks, visited, f);
+}
+
+void ot::prefetch_file(const char* path, off_t length)
+{
+#ifdef HAVE_POSIX_FADVISE
+	// O_NONBLOCK prevents us from hanging on FIFOs, and has no effect on regular files.
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+	close(fd);
+#endif
+}
+
 /**
  * Determine the file size, in bytes, of the given file. Return -1 on for streams.
  */
@@ -207,13 +451,13 @@ std::basic_string<OutChar> encoding_converter::convert(std::basic_string_view<In
 
 std::u8string ot::encode_utf8(std::string_view in)
 {
-	static encoding_converter to_utf8_cvt("", "UTF-8");
+	thread_local encoding_converter to_utf8_cvt("", "UTF-8");
 	return to_utf8_cvt.convert<char, char8_t>(in);
 }
 
 std::string ot::decode_utf8(std::u8string_view in)
 {
-	static encoding_converter from_utf8_cvt("UTF-8", "");
+	thread_local encoding_converter from_utf8_cvt("UTF-8", "");
 	return from_utf8_cvt.convert<char8_t, char>(in);
 }
 
@@ -254,10 +498,15 @@ void ot::run_editor(std::string_view editor, std::string_view path)
 
 timespec ot::get_file_timestamp(const char* path)
 {
-	timespec mtime;
 	struct stat st;
 	if (stat(path, &st) == -1)
 		throw status {st::standard_error, path + ": stat error: "s + strerror(errno)};
+	return get_file_timestamp(st);
+}
+
+timespec ot::get_file_timestamp(const struct stat& st)
+{
+	timespec mtime;
 #if defined(HAVE_STAT_ST_MTIM)
 	mtime = st.st_mtim;
 #elif defined(HAVE_STAT_ST_MTIMESPEC)
@@ -0,0 +1,258 @@
+/**
+ * \file src/verify.cc
+ * \ingroup ogg
+ *
+ * Integrity check of whole Ogg files, as specified by RFC 3533.
+ *
+ * The file is cut into ranges that are checked on several threads. Since the page boundaries are
+ * not known in advance, every range but the first one starts at the first capture pattern followed
+ * by a page whose CRC is valid, then follows the pages from there. The ranges are then stitched
+ * together in order: the first page of a range must start exactly where the last page of the
+ * previous range ended. When that is not the case, the synchronization point was found in the
+ * middle of a page, or the data between them is damaged, so the range is checked again starting
+ * from the end of the previous page, which gives the same result as a sequential check.
+ *
+ * The checks that span several pages, like the page sequence numbers, are performed within the
+ * ranges, and the first and last pages of every logical stream in a range are kept to check the
+ * transitions between ranges.
+ */
+
+#include <opustags.h>
+
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+namespace {
+
+/** The fields of an Ogg page header that matter for the checks. */
+struct page_info {
+	size_t offset;
+	size_t size;
+	uint32_t serialno;
+	uint32_t pageno;
+	int64_t granulepos;
+	bool continued;
+	bool bos;
+	bool eos;
+	/** True if the last packet of the page continues on the next page. */
+	bool unfinished;
+};
+
+/** Summary of the pages of a logical stream within a range. */
+struct stream_state {
+	page_info first;
+	page_info last;
+	/** First page in the range with a granule position, since -1 means no packet ends there. */
+	std::optional<page_info> first_granule;
+	std::optional<page_info> last_granule;
+};
+
+/** First problem found in a range, located by its offset in the file. */
+struct defect {
+	size_t offset;
+	std::string message;
+};
+
+struct range_result {
+	/** Offset of the first page, or the end of the range if no page starts in it. */
+	size_t start;
+	/** Offset following the last page checked. */
+	size_t next;
+	std::map<uint32_t, stream_state> streams;
+	std::optional<defect> failure;
+};
+
+}
+
+/**
+ * Parse the page at the given offset with #ot::parse_page, which also checks its CRC.
+ *
+ * Return nullptr on success, or a message explaining why the data does not make a valid page.
+ */
+static const char* read_page(ot::byte_string_view data, size_t offset, page_info& page)
+{
+	ogg_page ogg;
+	ot::page_check check = ot::parse_page(data.substr(offset), ogg);
+	if (check != ot::page_check::valid)
+		return ot::page_check_message(check);
+
+	const unsigned char* bytes = ogg.header;
+	uint64_t granulepos;
+	memcpy(&granulepos, bytes + 6, 8);
+	memcpy(&page.serialno, bytes + 14, 4);
+	memcpy(&page.pageno, bytes + 18, 4);
+	page.offset = offset;
+	page.size = ogg.header_len + ogg.body_len;
+	page.granulepos = static_cast<int64_t>(le64toh(granulepos));
+	page.serialno = le32toh(page.serialno);
+	page.pageno = le32toh(page.pageno);
+	page.continued = bytes[5] & 0x01;
+	page.bos = bytes[5] & 0x02;
+	page.eos = bytes[5] & 0x04;
+	page.unfinished = ogg.header_len > 27 && bytes[ogg.header_len - 1] == 255;
+	return nullptr;
+}
+
+static defect page_defect(const page_info& page, std::string_view problem)
+{
+	return {page.offset, "Page #" + std::to_string(page.pageno) + " of stream " +
+	                     std::to_string(page.serialno) + " at offset " +
+	                     std::to_string(page.offset) + ": " + std::string(problem) + "."};
+}
+
+/** Check the first page of a logical stream. */
+static std::optional<defect> check_first_page(const page_info& page)
+{
+	if (!page.bos)
+		return page_defect(page, "missing beginning of stream flag");
+	if (page.continued)
+		return page_defect(page, "the first page cannot continue a packet");
+	return {};
+}
+
+/** Check a page that follows another page of the same logical stream. */
+static std::optional<defect> check_next_page(const page_info& previous, const page_info& page)
+{
+	if (previous.eos)
+		return page_defect(page, "page after the end of stream");
+	if (page.bos)
+		return page_defect(page, "unexpected beginning of stream flag");
+	if (page.pageno != previous.pageno + 1)
+		return page_defect(page, "discontinuity after page #" + std::to_string(previous.pageno));
+	if (page.continued != previous.unfinished)
+		return page_defect(page, page.continued ? "continues a packet that was complete"
+		                                        : "does not continue the unfinished packet");
+	return {};
+}
+
+static std::optional<defect> check_granulepos(const page_info& previous, const page_info& page)
+{
+	if (page.granulepos < previous.granulepos)
+		return page_defect(page, "granule position decreased from " +
+		                         std::to_string(previous.granulepos));
+	return {};
+}
+
+/**
+ * Check the transitions of a logical stream from a previous state to the next pages. The state is
+ * updated to reflect the next pages.
+ */
+static std::optional<defect> merge_stream(stream_state& state, const stream_state& next)
+{
+	if (auto d = check_next_page(state.last, next.first))
+		return d;
+	if (state.last_granule && next.first_granule) {
+		if (auto d = check_granulepos(*state.last_granule, *next.first_granule))
+			return d;
+	}
+	state.last = next.last;
+	if (next.last_granule)
+		state.last_granule = next.last_granule;
+	return {};
+}
+
+/** Record the page in the range, and check it against the previous page of its stream. */
+static std::optional<defect> add_page(range_result& result, const page_info& page)
+{
+	stream_state next {page, page, {}, {}};
+	if (page.granulepos != -1)
+		next.first_granule = next.last_granule = page;
+	auto [it, inserted] = result.streams.try_emplace(page.serialno, next);
+	if (inserted)
+		return {};
+	return merge_stream(it->second, next);
+}
+
+/** Follow and check the pages starting at offset, until one starts beyond end. */
+static range_result check_pages(ot::byte_string_view data, size_t offset, size_t end)
+{
+	range_result result;
+	result.start = offset;
+	while (offset < end) {
+		page_info page;
+		if (const char* problem = read_page(data, offset, page)) {
+			result.failure = defect {offset, "Invalid page at offset " + std::to_string(offset) +
+			                                 ": " + problem + "."};
+			break;
+		}
+		if ((result.failure = add_page(result, page)))
+			break;
+		offset += page.size;
+	}
+	result.next = offset;
+	return result;
+}
+
+/** Find the first valid page starting within the range, and check the pages from there. */
+static range_result check_range(ot::byte_string_view data, size_t begin, size_t end)
+{
+	size_t offset = begin;
+	page_info page;
+	while (offset < end) {
+		size_t found = ot::find_capture_pattern(data.substr(0, end + 3), offset);
+		if (found == ot::byte_string_view::npos || found >= end) {
+			offset = end;
+			break;
+		}
+		offset = found;
+		if (read_page(data, offset, page) == nullptr)
+			break;
+		++offset;
+	}
+	return check_pages(data, offset, end);
+}
+
+void ot::verify_stream(byte_string_view data, unsigned threads, size_t range_size)
+{
+	if (data.empty())
+		throw status {st::bad_stream, "Empty stream."};
+	size_t ranges = (data.size() + range_size - 1) / range_size;
+	std::vector<range_result> results(ranges);
+	auto bounds = [&](size_t i) { return std::min(i * range_size, data.size()); };
+	results[0] = check_pages(data, 0, bounds(1));
+	if (ranges > 1) {
+		std::atomic<size_t> next_range = 1;
+		auto worker = [&] {
+			for (size_t i; (i = next_range++) < ranges;)
+				results[i] = check_range(data, bounds(i), bounds(i + 1));
+		};
+		std::vector<std::jthread> pool;
+		for (unsigned t = 1; t < std::min<size_t>(threads, ranges - 1); ++t)
+			pool.emplace_back(worker);
+		worker();
+	}
+
+	std::map<uint32_t, stream_state> streams;
+	size_t expected_start = 0;
+	for (size_t i = 0; i < ranges; ++i) {
+		range_result& result = results[i];
+		if (result.start != expected_start)
+			result = check_pages(data, expected_start, bounds(i + 1));
+		// Only the first defect in the file order is reported. Those found within the range
+		// come after any page they follow, so the transitions are checked before them.
+		std::optional<defect> failure = std::move(result.failure);
+		for (auto& [serialno, next] : result.streams) {
+			if (failure && failure->offset < next.first.offset)
+				continue;
+			std::optional<defect> d;
+			auto it = streams.find(serialno);
+			if (it == streams.end()) {
+				d = check_first_page(next.first);
+				streams.emplace(serialno, next);
+			} else {
+				d = merge_stream(it->second, next);
+			}
+			if (d && (!failure || d->offset < failure->offset))
+				failure = std::move(d);
+		}
+		if (failure)
+			throw status {st::bad_stream, failure->message};
+		expected_start = result.next;
+	}
+
+	for (const auto& [serialno, state] : streams) {
+		if (!state.last.eos)
+			throw status {st::bad_stream, page_defect(state.last, "missing end of stream flag").message};
+	}
+}
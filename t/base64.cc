@@ -1,6 +1,8 @@
 #include <opustags.h>
 #include "tap.h"
 
+#include <numeric>
+
 static void check_encode_base64()
 {
 	opaque_is(ot::encode_base64(""sv), u8"", "empty");
@@ -37,10 +39,109 @@ static void check_decode_base64()
 	}
 }
 
+static void check_base64_view()
+{
+	std::string data;
+	for (int i = 0; i < 100; ++i)
+		data.push_back(i * 7);
+	std::u8string encoded = ot::encode_base64(data);
+	ot::base64_view view(encoded);
+	if (view.size() != data.size())
+		throw failure("bad decoded size");
+	for (size_t offset = 0; offset <= data.size(); ++offset) {
+		for (size_t length : {0, 1, 2, 3, 4, 10}) {
+			length = std::min(length, data.size() - offset);
+			std::string out(length, '\0');
+			view.read(offset, length, out.data());
+			if (out != data.substr(offset, length))
+				throw failure("bad decoding at offset " + std::to_string(offset));
+		}
+	}
+
+	try {
+		ot::base64_view(u8"YWFh*WFh");
+		throw failure("accepted an invalid character");
+	} catch (const ot::status& e) {
+	}
+}
+
+/**
+ * Reference implementation of the codecs, a copy of the original byte-wise encoder, against
+ * which every codec is compared.
+ */
+static std::u8string reference_encode(const std::string& src)
+{
+	static const char8_t table[] = u8"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::u8string out;
+	for (size_t i = 0; i + 3 <= src.size(); i += 3) {
+		auto in = reinterpret_cast<const unsigned char*>(src.data() + i);
+		out.push_back(table[in[0] >> 2]);
+		out.push_back(table[((in[0] & 0x03) << 4) | (in[1] >> 4)]);
+		out.push_back(table[((in[1] & 0x0f) << 2) | (in[2] >> 6)]);
+		out.push_back(table[in[2] & 0x3f]);
+	}
+	return out;
+}
+
+/**
+ * Cross-check every codec the CPU supports with the reference on all the sizes around the widths
+ * of the vectorized kernels, at every alignment, and on every character for the validation.
+ */
+static void check_base64_codecs()
+{
+	std::string data(4096 + 16, '\0');
+	uint32_t seed = 1;
+	for (char& c : data) {
+		seed = seed * 1103515245 + 12345;
+		c = seed >> 24;
+	}
+	std::vector<size_t> group_counts(101);
+	std::iota(group_counts.begin(), group_counts.end(), 0);
+	group_counts.push_back(data.size() / 3 - 5);
+	for (const ot::base64_codec* codec : ot::base64_codecs()) {
+		std::string name = codec->name;
+		for (size_t offset = 0; offset < 16; ++offset) {
+			for (size_t groups : group_counts) {
+				std::string src = data.substr(offset, groups * 3);
+				std::u8string expected = reference_encode(src);
+				// Surround the output with canaries to catch overflows.
+				std::u8string encoded(groups * 4 + 2, u8'!');
+				codec->encode(reinterpret_cast<const unsigned char*>(src.data()), groups, encoded.data() + 1);
+				if (encoded.front() != u8'!' || encoded.back() != u8'!' ||
+				    encoded.substr(1, groups * 4) != expected)
+					throw failure(name + " encoding mismatch for " + std::to_string(groups) + " groups");
+				std::string decoded(groups * 3 + 2, '!');
+				codec->decode(expected.data(), groups,
+				              reinterpret_cast<unsigned char*>(decoded.data() + 1));
+				if (decoded.front() != '!' || decoded.back() != '!' ||
+				    decoded.substr(1, groups * 3) != src)
+					throw failure(name + " decoding mismatch for " + std::to_string(groups) + " groups");
+				if (!codec->validate(expected.data(), expected.size()))
+					throw failure(name + " rejected a valid string of " + std::to_string(groups) + " groups");
+			}
+		}
+
+		std::u8string text = reference_encode(data.substr(0, 96));
+		for (int c = 0; c < 256; ++c) {
+			bool valid = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+			             (c >= '0' && c <= '9') || c == '+' || c == '/';
+			for (size_t position = 0; position < text.size(); ++position) {
+				std::u8string altered = text;
+				altered[position] = c;
+				if (codec->validate(altered.data(), altered.size()) != valid)
+					throw failure(name + " misjudged character " + std::to_string(c) +
+					              " at position " + std::to_string(position));
+			}
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
-	std::cout << "1..2\n";
+	std::cout << "1..4\n";
 	run(check_encode_base64, "base64 encoding");
 	run(check_decode_base64, "base64 decoding");
+	run(check_base64_view, "base64 decoding on demand");
+	run(check_base64_codecs, "vectorized base64 codecs");
 	return 0;
 }
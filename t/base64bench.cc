@@ -0,0 +1,60 @@
+/**
+ * \file t/base64bench.cc
+ *
+ * Measure the throughput of every base64 codec supported by the CPU, on inputs from 1 KB, the size
+ * of a small thumbnail, to 64 MB, the size of the largest cover arts seen in the wild.
+ *
+ * This tool is not build by default or installed, and is only meant to evaluate the base64
+ * kernels. Build it with `make base64bench`.
+ */
+
+#include <opustags.h>
+
+#include <chrono>
+#include <iostream>
+
+/** Run the operation repeatedly for about the given amount of bytes, and return the GB/s. */
+template <typename F>
+static double measure(size_t size, size_t total, F operation)
+{
+	size_t rounds = total / size + 1;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; ++i)
+		operation();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return rounds * size / elapsed.count() / 1e9;
+}
+
+int main()
+{
+	size_t max_groups = (64 << 20) / 3;
+	std::basic_string<unsigned char> data(max_groups * 3, '\0');
+	uint32_t seed = 1;
+	for (unsigned char& c : data) {
+		seed = seed * 1103515245 + 12345;
+		c = seed >> 24;
+	}
+	std::u8string text(max_groups * 4, u8'\0');
+	std::cout << "codec\tsize\tencode (GB/s)\tdecode (GB/s)\tvalidate (GB/s)\n";
+	for (const ot::base64_codec* codec : ot::base64_codecs()) {
+		codec->encode(data.data(), max_groups, text.data());
+		for (size_t size : {1 << 10, 16 << 10, 256 << 10, 4 << 20, 64 << 20}) {
+			size_t groups = size / 3;
+			size_t total = 1ul << 30;
+			// Throughputs are measured on the decoded size, for all the operations.
+			double encode = measure(groups * 3, total, [&] {
+				codec->encode(data.data(), groups, text.data());
+			});
+			double decode = measure(groups * 3, total, [&] {
+				codec->decode(text.data(), groups, data.data());
+			});
+			double validate = measure(groups * 3, total, [&] {
+				if (!codec->validate(text.data(), groups * 4))
+					throw std::runtime_error("invalid base64");
+			});
+			std::cout << codec->name << "\t" << size << "\t" << encode << "\t\t"
+			          << decode << "\t\t" << validate << "\n";
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,139 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <stdio.h>
+
+static const char* catalog_path = "catalog.test";
+
+static void check_lookup()
+{
+	ot::catalog catalog;
+	ot::catalog_key key {1, 2, 300, {400, 500}};
+	if (catalog.find(key))
+		throw failure("found an entry in an empty catalog");
+	catalog.store(key, "OpusTags packet"sv);
+	opaque_is(catalog.find(key).value_or(""), "OpusTags packet"sv, "find a stored packet");
+
+	ot::catalog_key modified = key;
+	modified.mtime.tv_nsec = 501;
+	if (catalog.find(modified))
+		throw failure("found an entry after the file was modified");
+	modified = key;
+	modified.size = 301;
+	if (catalog.find(modified))
+		throw failure("found an entry after the file was resized");
+
+	modified.inode = 3;
+	catalog.store(modified, "Another packet"sv);
+	opaque_is(catalog.find(key).value_or(""), "OpusTags packet"sv, "keep the other entries");
+}
+
+static void check_persistence()
+{
+	remove(catalog_path);
+	ot::catalog_key first {1, 2, 300, {400, 500}};
+	ot::catalog_key second {1, 3, 4000000000, {-1, 999999999}};
+	{
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		catalog.store(first, "First packet"sv);
+		catalog.store(second, ot::byte_string("\0binary\0"sv));
+		catalog.save(catalog_path);
+	}
+	{
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		opaque_is(catalog.find(first).value_or(""), "First packet"sv, "reload the first entry");
+		opaque_is(catalog.find(second).value_or(""), "\0binary\0"sv, "reload the second entry");
+	}
+	{
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		catalog.find(first);
+		catalog.store(first, "First packet again"sv);
+		catalog.save(catalog_path);
+	}
+	{
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		opaque_is(catalog.find(second).value_or(""), "\0binary\0"sv, "keep the entries not looked up");
+		catalog.store(first, "First packet"sv);
+		catalog.save(catalog_path);
+	}
+	{
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		catalog.find(first);
+		catalog.prune();
+		catalog.save(catalog_path);
+	}
+	{
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		if (catalog.find(second))
+			throw failure("kept an entry that was pruned");
+		opaque_is(catalog.find(first).value_or(""), "First packet"sv, "keep the entry looked up");
+	}
+
+	// Truncate the catalog in the middle of the last entry.
+	ot::byte_string data = ot::slurp_binary_file(catalog_path);
+	{
+		ot::file output = fopen(catalog_path, "w");
+		fwrite(data.data(), 1, data.size() - 1, output.get());
+	}
+	try {
+		ot::catalog catalog;
+		catalog.load(catalog_path);
+		throw failure("loaded a truncated catalog");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::bad_catalog, "reject a truncated catalog");
+	}
+	remove(catalog_path);
+}
+
+static void check_covers()
+{
+	ot::opus_tags tags;
+	tags.vendor = u8"opustags";
+	tags.comments = {u8"TITLE=X"};
+	tags.comments.push_back(ot::make_cover("\x89PNG" + ot::byte_string(1000, 'x')));
+	ot::dynamic_ogg_packet packet = ot::render_tags(tags);
+	ot::byte_string_view data(reinterpret_cast<const char*>(packet.packet), packet.bytes);
+
+	ot::catalog catalog;
+	ot::catalog_key key {1, 2, 300, {400, 500}};
+	catalog.store(key, data);
+	if (catalog.find(key) || catalog.contains(key))
+		throw failure("found an entry with a summarized cover");
+	std::optional<ot::byte_string> summary = catalog.find(key, false);
+	if (!summary || summary->size() >= 200)
+		throw failure("the cover was not summarized");
+	ot::opus_tags summarized = ot::parse_tags_view(*summary);
+	opaque_is(summarized.comments[0], u8"TITLE=X"sv, "keep the other comments");
+	if (!tags.comments[1].starts_with(summarized.comments[1]))
+		throw failure("the summary is not the beginning of the cover");
+	if (!ot::match_tags(*summary, {ot::comment_selector(u8"metadata_block_picture")}))
+		throw failure("the cover was not found in the summary");
+}
+
+static void check_key()
+{
+	std::optional<ot::catalog_key> key = ot::get_catalog_key("gobble.opus");
+	if (!key)
+		throw failure("could not get the key of gobble.opus");
+	timespec mtime = ot::get_file_timestamp("gobble.opus");
+	if (key->size != 1191 || key->mtime.tv_sec != mtime.tv_sec || key->mtime.tv_nsec != mtime.tv_nsec)
+		throw failure("unexpected key for gobble.opus");
+	if (ot::get_catalog_key(".") || ot::get_catalog_key("missing.opus"))
+		throw failure("got a key for something that is not a regular file");
+}
+
+int main()
+{
+	plan(4);
+	run(check_lookup, "look up entries");
+	run(check_persistence, "save and load a catalog");
+	run(check_covers, "summarize the covers");
+	run(check_key, "build catalog keys");
+	return 0;
+}
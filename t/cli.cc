@@ -134,6 +134,35 @@ void check_good_arguments()
 	opt = parse({"opustags", "-a", "X=\xFF", "--raw", "x"});
 	if (!opt.raw || opt.to_add.front() != u8"X=\xFF")
 		throw failure("--raw did not disable transcoding");
+
+	opt = parse({"opustags", "x", "--padding", "1024"});
+	if (opt.padding != 1024)
+		throw failure("did not parse --padding");
+
+	opt = parse({"opustags", "-i", "x", "y", "-j", "8"});
+	if (opt.jobs != 8)
+		throw failure("did not parse -j");
+	opt = parse({"opustags", "-i", "x", "y"});
+	if (opt.jobs != 1)
+		throw failure("unexpected default number of jobs");
+
+	opt = parse({"opustags", "-iR", "--follow-symlinks", "x"});
+	if (!opt.recursive || !opt.follow_symlinks)
+		throw failure("did not parse --recursive and --follow-symlinks");
+
+	opt = parse({"opustags", "--link", "all", "x"});
+	if (opt.link != 0u)
+		throw failure("did not parse --link all");
+	opt = parse({"opustags", "--link", "3", "x"});
+	if (opt.link != 3u)
+		throw failure("did not parse --link 3");
+
+	opt = parse({"opustags", "x"});
+	if (opt.with_filename)
+		throw failure("enabled --with-filename for a single file");
+	opt = parse({"opustags", "x", "y"});
+	if (opt.paths_in.size() != 2 || !opt.with_filename)
+		throw failure("unexpected option parsing result for multiple read-only files");
 }
 
 void check_bad_arguments()
@@ -159,7 +188,7 @@ void check_bad_arguments()
 	error_case({"opustags", "--derp"}, "Unrecognized option '--derp'.", "unrecognized long option");
 	error_case({"opustags", "-x=y"}, "Unrecognized option '-x'.", "unrecognized short option with value");
 	error_case({"opustags", "--derp=y"}, "Unrecognized option '--derp=y'.", "unrecognized long option with value");
-	error_case({"opustags", "-aX=Y"}, "Exactly one input file must be specified.", "no input file");
+	error_case({"opustags", "-aX=Y"}, "At least one input file must be specified.", "no input file");
 	error_case({"opustags", "-i", "-o", "/dev/null", "-"}, "Cannot combine --in-place and --output.", "in-place + output");
 	error_case({"opustags", "-S", "-"}, "Cannot use standard input more than once.", "set all and read opus from stdin");
 	error_case({"opustags", "-i", "-"}, "Cannot modify standard input in place.", "write stdin in-place");
@@ -198,6 +227,29 @@ void check_bad_arguments()
 	error_case({"opustags", "-s", "X=\xFF", "x"},
 	           "Could not encode argument into UTF-8:",
 	           "-s with binary data");
+	error_case({"opustags", "--padding", "-1", "x"}, "Invalid padding size: -1.", "negative padding");
+	error_case({"opustags", "--padding", "1k", "x"}, "Invalid padding size: 1k.", "padding with a suffix");
+	error_case({"opustags", "--padding", "", "x"}, "Invalid padding size: .", "empty padding");
+	error_case({"opustags", "--padding", "4294967295", "x"}, "Invalid padding size: 4294967295.", "huge padding");
+	error_case({"opustags", "-j", "0", "-i", "x"}, "Invalid number of jobs: 0.", "zero jobs");
+	error_case({"opustags", "--jobs", "-2", "-i", "x"}, "Invalid number of jobs: -2.", "negative jobs");
+	error_case({"opustags", "-R", "x", "-o", "y"}, "Cannot use --recursive with --output.", "recursion with --output");
+	error_case({"opustags", "-i", "-H", "x"}, "--with-filename is only supported in read-only mode.", "--with-filename when editing");
+	error_case({"opustags", "-ieR", "x"}, "Cannot mix --edit with --recursive.", "recursive edition");
+	error_case({"opustags", "-i", "--catalog", "c", "x"}, "--catalog is only supported in read-only mode.", "--catalog when editing");
+	error_case({"opustags", "--prune-catalog", "x"}, "--prune-catalog requires --catalog.", "--prune-catalog without --catalog");
+	error_case({"opustags", "-i", "--json", "x"}, "--json is only supported in read-only mode.", "--json when editing");
+	error_case({"opustags", "--json", "--vendor", "x"}, "Cannot mix --json with --vendor.", "--json with --vendor");
+	error_case({"opustags", "--match-prefix", "X", "x"}, "Prefix selector does not contain an equal sign: X.", "--match-prefix without equal sign");
+	error_case({"opustags", "--match", "X", "-i", "x"}, "--match is only supported in read-only mode.", "--match when editing");
+	error_case({"opustags", "--match", "X", "--json", "x"}, "Cannot mix --match with --json, --vendor or --output-cover.", "--match with --json");
+	error_case({"opustags", "--match", "X", "-d", "Y", "x"}, "Cannot mix --match with tag edition.", "--match with --delete");
+	error_case({"opustags", "--verify", "-i", "x"}, "--verify is only supported in read-only mode.", "--verify when editing");
+	error_case({"opustags", "--verify", "--vendor", "x"}, "Cannot mix --verify with --json, --vendor, --match, --catalog or --output-cover.", "--verify with --vendor");
+	error_case({"opustags", "--verify", "-a", "X=Y", "x"}, "Cannot mix --verify with tag edition.", "--verify with --add");
+	error_case({"opustags", "--link", "0", "x"}, "Invalid link: 0.", "null link index");
+	error_case({"opustags", "--link", "first", "x"}, "Invalid link: first.", "invalid link index");
+	error_case({"opustags", "--link", "2", "--verify", "x"}, "Cannot mix --link with --verify, --match or --catalog.", "--link with --verify");
 }
 
 static void check_delete_comments()
@@ -223,12 +275,37 @@ static void check_delete_comments()
 		throw failure("did not delete a specific title correctly");
 }
 
+static void check_print_json()
+{
+	ot::opus_tags tags;
+	tags.vendor = u8"opustags";
+	tags.comments = {u8"TITLE=a \"b\"\\c", u8"X=line\n\ttab\x01", u8"Y=\xc3\xa9\xff", u8"BAD", u8"Z="};
+	tags.extra_data = "\0\0\0"s;
+	char* data = nullptr;
+	size_t size = 0;
+	{
+		ot::file output = open_memstream(&data, &size);
+		ot::print_json("dir/\x80.opus", tags, 4096, output.get());
+	}
+	std::unique_ptr<char, decltype(&free)> data_guard(data, &free);
+	opaque_is(std::string_view(data, size),
+	          "{\"path\":\"dir/\\udc80.opus\",\"vendor\":\"opustags\",\"comments\":["
+	          "[\"TITLE\",\"a \\\"b\\\"\\\\c\"],"
+	          "[\"X\",\"line\\n\\ttab\\u0001\"],"
+	          "[\"Y\",\"\xc3\xa9\\udcff\"],"
+	          "[\"BAD\",null],"
+	          "[\"Z\",\"\"]],"
+	          "\"extra_data\":3,\"bytes_read\":4096,\"cover\":null}\n"sv,
+	          "JSON output");
+}
+
 int main(int argc, char **argv)
 {
-	std::cout << "1..4\n";
+	std::cout << "1..5\n";
 	run(check_read_comments, "check tags parsing");
 	run(check_good_arguments, "check options parsing");
 	run(check_bad_arguments, "check options parsing errors");
 	run(check_delete_comments, "delete comments");
+	run(check_print_json, "print tags as JSON");
 	return 0;
 }
@@ -0,0 +1,52 @@
+/**
+ * \file t/crcbench.cc
+ *
+ * Measure the throughput of the Ogg page checksum, comparing #ot::set_page_checksum with libogg’s
+ * ogg_page_checksum_set on pages of typical and maximal sizes.
+ *
+ * This tool is not build by default or installed, and is only meant to evaluate the CRC kernels.
+ * Build it with `make crcbench`.
+ */
+
+#include <opustags.h>
+
+#include <chrono>
+#include <iostream>
+
+/** Checksum the page repeatedly for about the given amount of bytes, and return the GB/s. */
+template <typename F>
+static double measure(ogg_page& page, size_t total, F checksum)
+{
+	size_t rounds = total / (page.header_len + page.body_len) + 1;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; ++i) {
+		page.header[18] = i; // Prevent the compiler from hoisting the computation.
+		checksum(page);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return rounds * (page.header_len + page.body_len) / elapsed.count() / 1e9;
+}
+
+int main()
+{
+	unsigned char header[27 + 255] = {'O', 'g', 'g', 'S'};
+	ot::byte_string body(65025, '\0');
+	uint32_t seed = 1;
+	for (char& c : body) {
+		seed = seed * 1103515245 + 12345;
+		c = seed >> 24;
+	}
+	std::cout << "page size\tlibogg (GB/s)\topustags (GB/s)\n";
+	for (size_t size : {256, 4096, 65025}) {
+		ogg_page page {};
+		page.header = header;
+		page.header_len = 27 + (size + 254) / 255;
+		page.body = reinterpret_cast<unsigned char*>(body.data());
+		page.body_len = size;
+		size_t total = 1ul << 30;
+		double reference = measure(page, total, [](ogg_page& p) { ogg_page_checksum_set(&p); });
+		double ours = measure(page, total, [](ogg_page& p) { ot::set_page_checksum(p); });
+		std::cout << size << "\t\t" << reference << "\t\t" << ours << "\n";
+	}
+	return 0;
+}
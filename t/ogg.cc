@@ -2,6 +2,7 @@
 #include "tap.h"
 
 #include <string.h>
+#include <unistd.h>
 
 static void check_ref_ogg()
 {
@@ -65,6 +66,7 @@ static void check_memory_ogg()
 		ot::ogg_writer writer(output.get());
 		writer.write_header_packet(1234, 0, first_packet);
 		writer.write_header_packet(1234, 1, second_packet);
+		writer.flush();
 		my_ogg_size = ftell(output.get());
 		if (my_ogg_size != 67)
 			throw failure("unexpected output size");
@@ -92,6 +94,139 @@ static void check_memory_ogg()
 	}
 }
 
+/**
+ * Check that reading the header pages does not read much beyond them, and that the read size
+ * then grows to read the rest of the stream.
+ */
+static void check_header_probe()
+{
+	ogg_packet head = make_packet("OpusHead");
+	ogg_packet tags = make_packet("OpusTags");
+	std::string audio(1000, 'x');
+	ogg_packet audio_packet = make_packet(audio.c_str());
+	char* buf;
+	size_t size;
+	{
+		ot::file output = open_memstream(&buf, &size);
+		if (output == nullptr)
+			throw failure("could not open the output stream");
+		ot::ogg_writer writer(output.get());
+		writer.write_header_packet(1234, 0, head);
+		writer.write_header_packet(1234, 1, tags);
+		for (long pageno = 2; pageno < 200; ++pageno)
+			writer.write_header_packet(1234, pageno, audio_packet);
+	}
+	std::unique_ptr<char, decltype(&free)> my_ogg(buf, &free);
+
+	ot::file input = fmemopen(buf, size, "r");
+	if (input == nullptr)
+		throw failure("could not open the input stream");
+	ot::ogg_reader reader(input.get());
+	if (reader.next_page() != true || reader.next_page() != true)
+		throw failure("could not read the header pages");
+	if (reader.bytes_read > 4096)
+		throw failure("read too much to get the headers");
+	while (reader.next_page());
+	is(reader.bytes_read, size, "read the whole stream");
+	is(reader.read_size, ot::ogg_reader::max_read_size, "grew the read size");
+}
+
+/**
+ * Copy gobble.opus through writers of various batch sizes, including batches smaller than the
+ * pages, and check that the output is written only when the batch is full or flushed.
+ */
+static void check_batched_writer()
+{
+	ot::byte_string gobble = ot::slurp_binary_file("gobble.opus");
+	for (size_t batch_size : {0ul, 100ul, 1000ul, ot::ogg_writer::default_batch_size}) {
+		char* buf;
+		size_t size;
+		{
+			ot::file output = open_memstream(&buf, &size);
+			if (output == nullptr)
+				throw failure("could not open the output stream");
+			ot::ogg_writer writer(output.get(), batch_size);
+			ot::file input = fmemopen(gobble.data(), gobble.size(), "r");
+			ot::ogg_reader reader(input.get());
+			while (reader.next_page())
+				writer.write_page(reader.page);
+			if (batch_size == ot::ogg_writer::default_batch_size && ftell(output.get()) != 0)
+				throw failure("wrote the pages before the batch was full");
+			writer.flush();
+		}
+		std::unique_ptr<char, decltype(&free)> copy(buf, &free);
+		if (std::string_view(buf, size) != gobble)
+			throw failure("bad copy with batches of " + std::to_string(batch_size) + " bytes");
+	}
+}
+
+static std::string_view page_view(const unsigned char* data, long size)
+{
+	return {reinterpret_cast<const char*>(data), static_cast<size_t>(size)};
+}
+
+/**
+ * Read gobble.opus both through stdio and through a memory mapping, and check that both readers
+ * yield the same pages.
+ */
+static void check_mapped_ogg()
+{
+	ot::file stdio_input = fopen("gobble.opus", "r");
+	ot::file mapped_input = fopen("gobble.opus", "r");
+	if (stdio_input == nullptr || mapped_input == nullptr)
+		throw failure("could not open gobble.opus");
+	ot::ogg_reader stdio_reader(stdio_input.get());
+	ot::ogg_reader mapped_reader(mapped_input.get());
+	if (!mapped_reader.map_input())
+		throw failure("could not map gobble.opus");
+
+	while (stdio_reader.next_page()) {
+		if (!mapped_reader.next_page())
+			throw failure("the mapped stream ended early");
+		if (page_view(mapped_reader.page.header, mapped_reader.page.header_len) !=
+		    page_view(stdio_reader.page.header, stdio_reader.page.header_len) ||
+		    page_view(mapped_reader.page.body, mapped_reader.page.body_len) !=
+		    page_view(stdio_reader.page.body, stdio_reader.page.body_len))
+			throw failure("the mapped page differs from the read page");
+		if (mapped_reader.page_offset != stdio_reader.page_offset)
+			throw failure("the mapped page offset differs from the read one");
+	}
+	if (mapped_reader.next_page())
+		throw failure("the mapped stream has extra pages");
+	is(mapped_reader.bytes_read, stdio_reader.bytes_read, "mapped bytes");
+
+	int pipe_fds[2];
+	if (pipe(pipe_fds) == -1)
+		throw failure("could not create a pipe");
+	ot::file pipe_output = fdopen(pipe_fds[1], "w");
+	ot::file pipe_input = fdopen(pipe_fds[0], "r");
+	ot::ogg_reader pipe_reader(pipe_input.get());
+	if (pipe_reader.map_input())
+		throw failure("mapped a pipe");
+
+	// Corrupt a byte of the first page body and make sure the CRC check catches it.
+	char corrupted_path[] = "mapped.XXXXXX.opus";
+	int fd = mkstemps(corrupted_path, 5);
+	if (fd == -1)
+		throw failure("could not create a temporary file");
+	ot::file corrupted = fdopen(fd, "w+");
+	ot::byte_string data = ot::slurp_binary_file("gobble.opus");
+	data[30] ^= 1;
+	fwrite(data.data(), 1, data.size(), corrupted.get());
+	fflush(corrupted.get());
+	rewind(corrupted.get());
+	ot::ogg_reader corrupted_reader(corrupted.get());
+	remove(corrupted_path);
+	if (!corrupted_reader.map_input())
+		throw failure("could not map the corrupted file");
+	try {
+		corrupted_reader.next_page();
+		throw failure("accepted a page with a bad CRC");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::bad_stream, "bad CRC");
+	}
+}
+
 void check_bad_stream()
 {
 	auto err_msg = "did not detect the stream is not an ogg stream";
@@ -104,6 +239,16 @@ void check_bad_stream()
 		if (rc != ot::st::bad_stream)
 			throw failure(err_msg);
 	}
+
+	ot::byte_string gobble = ot::slurp_binary_file("gobble.opus");
+	ot::file truncated = fmemopen(gobble.data(), gobble.size() - 1, "r");
+	ot::ogg_reader truncated_reader(truncated.get());
+	try {
+		while (truncated_reader.next_page());
+		throw failure("did not detect the truncated page");
+	} catch (const ot::status& rc) {
+		is(rc.message, "Unsynced data at end of stream.", "truncated stream");
+	}
 }
 
 void check_identification()
@@ -137,6 +282,66 @@ void check_identification()
 		"\xe6\xc7\x00\x00\x00\x00\x7e\xc3\x57\x2b\x01\x13";
 	if (ot::is_opus_stream(id))
 		throw failure("was not the beginning of a stream");
+
+	// The same checks from the first bytes of a file.
+	std::string head = std::string(reinterpret_cast<const char*>(good_header), 28) + "OpusHead";
+	if (!ot::starts_as_opus_stream(head))
+		throw failure("could not identify opus from the first bytes");
+	if (ot::starts_as_opus_stream(head.substr(0, 35)))
+		throw failure("identified a truncated opus header");
+	if (ot::starts_as_opus_stream("\x89PNG\r\n\x1a\n"sv))
+		throw failure("identified a PNG file as opus");
+	std::string skeleton = std::string(reinterpret_cast<const char*>(good_header), 27) + "\x08" + "fishead"s + '\0';
+	if (!ot::starts_as_opus_stream(skeleton + head))
+		throw failure("could not identify opus after a skeleton stream");
+	if (ot::starts_as_opus_stream(skeleton + skeleton))
+		throw failure("identified a skeleton stream as opus");
+	head[5] = 0;
+	if (ot::starts_as_opus_stream(head))
+		throw failure("identified opus without the BoS flag");
+}
+
+void check_last_page()
+{
+	ot::byte_string gobble = ot::slurp_binary_file("gobble.opus");
+	const int serialno = static_cast<int>(0xc7e6f242);
+	if (ot::last_page_serialno(gobble) != serialno)
+		throw failure("did not find the last page");
+	if (ot::last_page_serialno(gobble.substr(300)) != serialno)
+		throw failure("did not find the last page from the tail of the file");
+	if (ot::last_page_serialno(gobble.substr(0, gobble.size() - 1)))
+		throw failure("found a truncated last page");
+	if (ot::last_page_serialno("OggS"sv))
+		throw failure("found a page in garbage");
+	gobble[gobble.size() - 1] ^= 1;
+	if (ot::last_page_serialno(gobble))
+		throw failure("found a corrupted last page");
+}
+
+void check_parse_page()
+{
+	ot::byte_string gobble = ot::slurp_binary_file("gobble.opus");
+	ogg_page page;
+	if (ot::parse_page(gobble, page) != ot::page_check::valid || !ot::is_opus_stream(page))
+		throw failure("could not parse the first page");
+	size_t size = page.header_len + page.body_len;
+	if (ot::parse_page(gobble.substr(0, 26), page) != ot::page_check::truncated_header)
+		throw failure("parsed a truncated header");
+	if (ot::parse_page(gobble.substr(0, size - 1), page) != ot::page_check::truncated_page ||
+	    static_cast<size_t>(page.header_len + page.body_len) != size - 1)
+		throw failure("parsed a truncated page");
+	if (ot::parse_page(gobble.substr(1), page) != ot::page_check::missing_capture_pattern)
+		throw failure("parsed a page without its capture pattern");
+	ot::byte_string corrupted = gobble;
+	corrupted[4] = 1;
+	if (ot::parse_page(corrupted, page) != ot::page_check::unsupported_version)
+		throw failure("parsed a page of an unknown version");
+	corrupted = gobble;
+	corrupted[size - 1] ^= 1;
+	if (ot::parse_page(corrupted, page) != ot::page_check::checksum_mismatch)
+		throw failure("parsed a corrupted page");
+	if (ot::parse_page(corrupted, page, false) != ot::page_check::valid)
+		throw failure("checked the CRC when told not to");
 }
 
 void check_renumber_page()
@@ -153,15 +358,259 @@ void check_renumber_page()
 	ot::renumber_page(reader.page, new_pageno);
 	if (ogg_page_pageno(&reader.page) != new_pageno)
 		throw failure("renumbering failed");
+	if (!ot::check_page_checksum(reader.page))
+		throw failure("the checksum was not updated");
+
+	// Renumber a larger audio page too.
+	while (reader.next_page() && reader.page.body_len < 1000);
+	ot::renumber_page(reader.page, 0x12345678);
+	if (ogg_page_pageno(&reader.page) != 0x12345678 || !ot::check_page_checksum(reader.page))
+		throw failure("could not renumber an audio page");
+}
+
+/** Compare our CRC implementation with libogg’s on pages of various sizes and alignments. */
+void check_crc()
+{
+	ot::byte_string data(4096 + 64, '\0');
+	uint32_t seed = 1;
+	for (char& c : data) {
+		seed = seed * 1103515245 + 12345;
+		c = seed >> 24;
+	}
+	unsigned char header[27] = {'O', 'g', 'g', 'S'};
+	for (size_t offset : {0, 1, 7}) {
+		for (size_t size : {0, 1, 15, 16, 63, 64, 65, 127, 200, 1000, 4096}) {
+			ogg_page page {};
+			page.header = header;
+			page.header_len = sizeof(header);
+			page.body = reinterpret_cast<unsigned char*>(data.data() + offset);
+			page.body_len = size;
+			ogg_page_checksum_set(&page);
+			if (!ot::check_page_checksum(page))
+				throw failure("mismatching checksum for " + std::to_string(size) + " bytes");
+			uint32_t expected;
+			memcpy(&expected, header + 22, 4);
+			memset(header + 22, 0xff, 4);
+			ot::set_page_checksum(page);
+			if (memcmp(&expected, header + 22, 4) != 0)
+				throw failure("wrong checksum for " + std::to_string(size) + " bytes");
+			++page.body[0];
+			if (size > 0 && ot::check_page_checksum(page))
+				throw failure("accepted a corrupted page");
+			--page.body[0];
+		}
+	}
+
+	// The CRC can be computed incrementally.
+	ot::byte_string_view view(data);
+	uint32_t crc = ot::ogg_crc32(0, view);
+	if (ot::ogg_crc32(ot::ogg_crc32(0, view.substr(0, 1234)), view.substr(1234)) != crc)
+		throw failure("incremental checksum mismatch");
+
+	ot::byte_string zeros(1000, '\0');
+	if (ot::ogg_crc32_zeros(crc, zeros.size()) != ot::ogg_crc32(crc, zeros))
+		throw failure("wrong checksum for appended null bytes");
+}
+
+/**
+ * Compare #ot::find_capture_pattern with a plain search, on data full of partial patterns, at every
+ * offset so that the pattern is found at every position of the SIMD blocks and across them.
+ */
+static void check_capture_pattern()
+{
+	std::string data;
+	uint32_t seed = 1;
+	for (size_t i = 0; i < 300; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data += "OggS"sv.substr(0, seed >> 30);
+		data += seed >> 28 == 0 ? "OggS"sv : "x"sv;
+	}
+	for (size_t size : {0ul, 3ul, 4ul, 34ul, 35ul, data.size()}) {
+		std::string_view view = std::string_view(data).substr(0, size);
+		for (size_t offset = 0; offset <= size + 1; ++offset) {
+			if (ot::find_capture_pattern(view, offset) != view.find("OggS"sv, offset))
+				throw failure("wrong position from offset " + std::to_string(offset) +
+				              " in " + std::to_string(size) + " bytes");
+		}
+	}
+	if (ot::find_capture_pattern(std::string(100, 'x') + "OggS") != 100)
+		throw failure("did not find the pattern at the end");
+}
+
+/** Return the error message of #ot::verify_stream, or an empty string if the stream is valid. */
+static std::string verify(ot::byte_string_view data, size_t range_size)
+{
+	try {
+		ot::verify_stream(data, 4, range_size);
+		return {};
+	} catch (const ot::status& rc) {
+		return rc.message;
+	}
+}
+
+void check_verify()
+{
+	ot::byte_string gobble = ot::slurp_binary_file("gobble.opus");
+	std::vector<size_t> range_sizes = {1, 20, 100, 1000, 1 << 20};
+	for (size_t range_size : range_sizes) {
+		if (auto error = verify(gobble, range_size); !error.empty())
+			throw failure("rejected a valid stream: " + error);
+	}
+
+	// A stream whose only page contains the first page of gobble.opus, which looks like a valid
+	// page to the threads that start scanning in the middle of it.
+	unsigned char header[28] = {'O', 'g', 'g', 'S', 0, 0x06};
+	header[14] = 42; // serialno
+	header[26] = 1;
+	header[27] = 47;
+	ogg_page page {header, sizeof(header), reinterpret_cast<unsigned char*>(gobble.data()), 47};
+	ot::set_page_checksum(page);
+	ot::byte_string nested = ot::byte_string(reinterpret_cast<char*>(header), sizeof(header)) +
+	                         gobble.substr(0, 47) + gobble;
+	for (size_t range_size : range_sizes) {
+		if (auto error = verify(nested, range_size); !error.empty())
+			throw failure("rejected a stream with a nested page: " + error);
+	}
+
+	auto expect = [&](const ot::byte_string& data, std::string_view message) {
+		for (size_t range_size : range_sizes)
+			is(verify(data, range_size), message, "defect detected");
+	};
+	ot::byte_string corrupted = gobble;
+	corrupted[500] ^= 1;
+	expect(corrupted, "Invalid page at offset 137: CRC mismatch.");
+	expect(gobble.substr(0, 1100), "Invalid page at offset 137: truncated page.");
+	expect(gobble.substr(0, 1133), "Page #2 of stream 3353801282 at offset 137: missing end of stream flag.");
+	expect(gobble + "x", "Invalid page at offset 1191: truncated page header.");
+	expect(gobble.substr(47), "Page #1 of stream 3353801282 at offset 0: missing beginning of stream flag.");
+	expect(gobble.substr(0, 47) + gobble.substr(137),
+	       "Page #2 of stream 3353801282 at offset 47: discontinuity after page #0.");
+	expect(gobble + gobble, "Page #0 of stream 3353801282 at offset 1191: page after the end of stream.");
+	expect("", "Empty stream.");
+}
+
+/** Compare the pagination of header packets of various sizes with libogg’s. */
+static void check_paginate_header()
+{
+	for (size_t size : {0, 1, 254, 255, 256, 65024, 65025, 65279, 65280, 200000}) {
+		for (int pageno : {0, 1}) {
+			ot::byte_string data(size, '\0');
+			for (size_t i = 0; i < size; ++i)
+				data[i] = i * 31;
+			ogg_packet packet {};
+			packet.packet = reinterpret_cast<unsigned char*>(data.data());
+			packet.bytes = size;
+			packet.packetno = 1;
+
+			std::string expected;
+			ot::ogg_logical_stream stream(1234);
+			stream.b_o_s = (pageno != 0);
+			stream.pageno = pageno;
+			ogg_stream_packetin(&stream, &packet);
+			ogg_page page;
+			while (ogg_stream_flush(&stream, &page) != 0) {
+				expected.append(reinterpret_cast<char*>(page.header), page.header_len);
+				expected.append(reinterpret_cast<char*>(page.body), page.body_len);
+			}
+
+			std::string pages;
+			long count = 0;
+			ot::paginate_header_packet(1234, pageno, packet, [&](const ogg_page& p) {
+				pages.append(reinterpret_cast<char*>(p.header), p.header_len);
+				pages.append(reinterpret_cast<char*>(p.body), p.body_len);
+				++count;
+			});
+			std::string name = "packet of " + std::to_string(size) + " bytes on page " +
+			                   std::to_string(pageno);
+			if (pages != expected)
+				throw failure("bad pages for a " + name);
+			ot::header_pages layout = ot::header_pages_layout(size);
+			if (layout.count != count || layout.size != pages.size())
+				throw failure("bad layout for a " + name);
+		}
+	}
+}
+
+/**
+ * Read a header packet spanning several pages, with a page of another stream in the middle, as
+ * pieces. Then check that a missing page is detected.
+ */
+static void check_header_pages()
+{
+	ot::byte_string data(200000, '\0');
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = i * 31;
+	ogg_packet packet {};
+	packet.packet = reinterpret_cast<unsigned char*>(data.data());
+	packet.bytes = data.size();
+	std::vector<std::string> pages;
+	ot::paginate_header_packet(1234, 1, packet, [&](const ogg_page& p) {
+		pages.emplace_back(reinterpret_cast<char*>(p.header), p.header_len);
+		pages.back().append(reinterpret_cast<char*>(p.body), p.body_len);
+	});
+	ot::paginate_header_packet(5678, 0, make_packet("Foreign"), [&](const ogg_page& p) {
+		std::string page(reinterpret_cast<char*>(p.header), p.header_len);
+		page.append(reinterpret_cast<char*>(p.body), p.body_len);
+		pages.insert(pages.begin() + 1, page);
+	});
+
+	auto read = [&](const std::string& stream, std::vector<ot::byte_string>& pieces) {
+		ot::file input = fmemopen(const_cast<char*>(stream.data()), stream.size(), "r");
+		ot::ogg_reader reader(input.get());
+		if (!reader.next_page())
+			throw failure("could not read the first page");
+		int foreign = 0;
+		reader.process_header_pages([&](ot::byte_string_view piece) {
+			pieces.emplace_back(piece);
+		}, [&](const ogg_page&) { ++foreign; });
+		if (foreign != 1)
+			throw failure("the foreign page was not passed along");
+	};
+	std::string stream;
+	for (const std::string& page : pages)
+		stream += page;
+	std::vector<ot::byte_string> pieces;
+	read(stream, pieces);
+	if (pieces.size() != 4 || pieces[0].size() != 255 * 255)
+		throw failure("the pieces did not match the pages");
+	ot::byte_string joined;
+	for (const ot::byte_string& piece : pieces)
+		joined += piece;
+	if (joined != data)
+		throw failure("the pieces did not make the packet");
+
+	stream.clear();
+	for (size_t i = 0; i < pages.size(); ++i) {
+		if (i != 2)
+			stream += pages[i];
+	}
+	try {
+		pieces.clear();
+		read(stream, pieces);
+		throw failure("did not detect the missing page");
+	} catch (const ot::status& rc) {
+		if (rc != ot::st::bad_stream)
+			throw failure("unexpected error for the missing page: " + rc.message);
+	}
 }
 
 int main(int argc, char **argv)
 {
-	std::cout << "1..5\n";
+	std::cout << "1..15\n";
 	run(check_ref_ogg, "check a reference ogg stream");
 	run(check_memory_ogg, "build and check a fresh stream");
+	run(check_header_probe, "read the headers with minimal I/O");
+	run(check_batched_writer, "write the pages by batches");
+	run(check_mapped_ogg, "read a memory-mapped stream");
 	run(check_bad_stream, "read a non-ogg stream");
 	run(check_identification, "stream identification");
+	run(check_parse_page, "page parsing");
 	run(check_renumber_page, "page renumbering");
+	run(check_last_page, "find the last page");
+	run(check_crc, "page checksums");
+	run(check_capture_pattern, "capture pattern search");
+	run(check_verify, "stream integrity verification");
+	run(check_paginate_header, "header packet pagination");
+	run(check_header_pages, "read a header packet page by page");
 	return 0;
 }
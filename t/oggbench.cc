@@ -0,0 +1,167 @@
+/**
+ * \file t/oggbench.cc
+ *
+ * Measure the throughput of the page scanner of #ot::ogg_reader, through its buffer and through a
+ * mapping, comparing it with libogg’s sync layer fed from the same file, as opustags did before
+ * it parsed the pages itself. The search for the capture pattern is also compared with
+ * byte_string_view::find, and the batches of #ot::ogg_writer with the two fwrite calls per page it
+ * used to make.
+ *
+ * This tool is not build by default or installed, and is only meant to evaluate the Ogg reader.
+ * Build it with `make oggbench`.
+ */
+
+#include <opustags.h>
+
+#include <chrono>
+#include <iostream>
+
+/** Run the operation, which processes the given amount of bytes, and return the GB/s. */
+template <typename F>
+static double measure(size_t size, F operation)
+{
+	auto start = std::chrono::steady_clock::now();
+	operation();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return size / elapsed.count() / 1e9;
+}
+
+/**
+ * Write a stream of about total bytes made of pages with the given body size into the file. The
+ * body must be shorter than 255 segments of 255 bytes to fit in a single page.
+ */
+static size_t write_stream(FILE* file, size_t body_size, size_t total)
+{
+	ot::byte_string body(body_size, '\0');
+	uint32_t seed = 1;
+	for (char& c : body) {
+		seed = seed * 1103515245 + 12345;
+		c = seed >> 24;
+	}
+	ogg_packet packet {};
+	packet.packet = reinterpret_cast<unsigned char*>(body.data());
+	packet.bytes = body.size();
+	ot::ogg_writer writer(file);
+	for (int pageno = 0; ftell(file) < static_cast<long>(total); ++pageno) {
+		body[0] = pageno;
+		writer.write_header_packet(1234, pageno, packet);
+	}
+	fflush(file);
+	return ftell(file);
+}
+
+/** Read all the pages of the file like opustags did before with libogg, and count them. */
+static size_t read_with_libogg(FILE* file)
+{
+	ogg_sync_state sync;
+	ogg_sync_init(&sync);
+	ogg_page page;
+	size_t pages = 0;
+	for (;;) {
+		int rc = ogg_sync_pageout(&sync, &page);
+		if (rc == 1) {
+			++pages;
+			continue;
+		}
+		if (rc == -1 || feof(file))
+			break;
+		char* buf = ogg_sync_buffer(&sync, ot::ogg_reader::max_read_size);
+		ogg_sync_wrote(&sync, fread(buf, 1, ot::ogg_reader::max_read_size, file));
+	}
+	ogg_sync_clear(&sync);
+	return pages;
+}
+
+static size_t read_with_opustags(FILE* file, bool mapped)
+{
+	ot::ogg_reader reader(file);
+	reader.read_size = ot::ogg_reader::max_read_size;
+	if (mapped && !reader.map_input())
+		throw std::runtime_error("could not map the stream");
+	size_t pages = 0;
+	while (reader.next_page())
+		++pages;
+	return pages;
+}
+
+int main()
+{
+	std::cout << "page size\tlibogg (GB/s)\tbuffered (GB/s)\tmapped (GB/s)\n";
+	for (size_t body_size : {200, 4000, 65024}) {
+		ot::file file = tmpfile();
+		setvbuf(file.get(), nullptr, _IONBF, 0);
+		size_t size = write_stream(file.get(), body_size, 256 << 20);
+		auto run = [&](auto read) {
+			rewind(file.get());
+			read_with_opustags(file.get(), true); // Warm up the page cache.
+			rewind(file.get());
+			return measure(size, [&] { read(file.get()); });
+		};
+		double reference = run(read_with_libogg);
+		double buffered = run([](FILE* f) { return read_with_opustags(f, false); });
+		double mapped = run([](FILE* f) { return read_with_opustags(f, true); });
+		std::cout << body_size << "\t\t" << reference << "\t\t" << buffered << "\t\t" << mapped << "\n";
+	}
+
+	std::cout << "\npage size\tfwrite (GB/s)\t";
+	std::vector<size_t> batch_sizes = {64 << 10, 1 << 20, 4 << 20};
+	for (size_t batch_size : batch_sizes)
+		std::cout << "batch " << (batch_size >> 10) << " KiB (GB/s)\t";
+	std::cout << "\n";
+	for (size_t body_size : {200, 4000, 65024}) {
+		ot::file input = tmpfile();
+		size_t size = write_stream(input.get(), body_size, 256 << 20);
+		rewind(input.get());
+		ot::ogg_reader reader(input.get());
+		reader.map_input();
+		std::vector<ogg_page> pages;
+		while (reader.next_page())
+			pages.push_back(reader.page);
+		ot::file output = tmpfile();
+		auto run = [&](auto write) {
+			rewind(output.get());
+			return measure(size, [&] { write(output.get()); });
+		};
+		std::cout << body_size << "\t\t" << run([&](FILE* output) {
+			for (const ogg_page& page : pages) {
+				fwrite(page.header, 1, page.header_len, output);
+				fwrite(page.body, 1, page.body_len, output);
+			}
+			fflush(output);
+		});
+		for (size_t batch_size : batch_sizes) {
+			std::cout << "\t\t" << run([&](FILE* output) {
+				ot::ogg_writer writer(output, batch_size);
+				for (const ogg_page& page : pages) {
+					writer.next_page_no[1234] = ogg_page_pageno(&page);
+					writer.write_page(page);
+				}
+				writer.flush();
+			});
+		}
+		std::cout << "\n";
+	}
+
+	std::cout << "\ncapture pattern search\tfind (GB/s)\topustags (GB/s)\n";
+	ot::byte_string data(64 << 20, '\0');
+	uint32_t seed = 1;
+	for (char& c : data) {
+		seed = seed * 1103515245 + 12345;
+		c = seed >> 24;
+	}
+	// Compressed data has no capture pattern, but its first byte is as frequent as any other.
+	for (size_t i = data.find("OggS"sv); i != ot::byte_string_view::npos; i = data.find("OggS"sv, i))
+		data[i] = 'x';
+	for (auto [name, byte] : {std::pair{"random data", '\0'}, std::pair{"repeated O", 'O'}}) {
+		ot::byte_string input = data;
+		if (byte)
+			std::fill(input.begin(), input.end(), byte);
+		size_t found[2];
+		double reference = measure(input.size(), [&] { found[0] = input.find("OggS"sv); });
+		double ours = measure(input.size(), [&] { found[1] = ot::find_capture_pattern(input); });
+		if (found[0] != found[1])
+			throw std::runtime_error("the searches disagree");
+		std::cout << name << "\t\t\t" << reference << "\t\t" << ours << "\n";
+	}
+	return 0;
+}
@@ -2,6 +2,9 @@
 #include "tap.h"
 
 #include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <thread>
 
 static const char standard_OpusTags[] =
 	"OpusTags"
@@ -30,6 +33,54 @@ static void parse_standard()
 		throw failure("found mysterious padding data");
 }
 
+static std::string rendered(const ot::comment_list& comments)
+{
+	std::string out(comments.rendered_size(), '\0');
+	comments.render(out.data());
+	return out;
+}
+
+static void edit_comments()
+{
+	ot::opus_tags tags = ot::parse_tags_view(ot::byte_string_view(standard_OpusTags, sizeof(standard_OpusTags) - 1));
+	if (tags.comments.size() != 2 || tags.comments[1] != u8"ARTIST=Bar")
+		throw failure("bad comments in the lazy parse");
+	if (tags.comments[0].data() != reinterpret_cast<const char8_t*>(standard_OpusTags + 40))
+		throw failure("the comments were copied");
+
+	tags.comments.push_back(u8"TITLE=Baz");
+	tags.comments.push_back(u8"");
+	tags.comments.remove_if([](std::u8string_view c) { return c.starts_with(u8"TITLE="); });
+	if (tags.comments.size() != 2 || tags.comments[0] != u8"ARTIST=Bar" || tags.comments[1] != u8"")
+		throw failure("bad comments after the removal");
+	if (tags.comments[0].data() != reinterpret_cast<const char8_t*>(standard_OpusTags + 53))
+		throw failure("an untouched comment was copied");
+	if (rendered(tags.comments) != "\x0a\x00\x00\x00" "ARTIST=Bar" "\x00\x00\x00\x00"sv)
+		throw failure("bad rendering of the edited comments");
+	tags.comments.detach();
+	if (tags.comments[0] != u8"ARTIST=Bar" ||
+	    tags.comments[0].data() == reinterpret_cast<const char8_t*>(standard_OpusTags + 53))
+		throw failure("the comments were not detached");
+
+	std::list<std::u8string> list = tags.comments;
+	if (list != std::list<std::u8string> {u8"ARTIST=Bar", u8""})
+		throw failure("bad conversion to a list");
+	ot::comment_list flat = list;
+	if (rendered(flat) != rendered(tags.comments))
+		throw failure("bad conversion from a list");
+	flat.clear();
+	if (!flat.empty() || flat.rendered_size() != 0)
+		throw failure("the list was not cleared");
+
+	int writes = 0;
+	flat.push_back(u8"A=1");
+	flat.push_back({3, [&](char* out) { memcpy(out, "B=2", 3); ++writes; }});
+	if (rendered(flat) != "\x03\x00\x00\x00" "A=1" "\x03\x00\x00\x00" "B=2"sv || writes != 1)
+		throw failure("bad rendering of a deferred comment");
+	if (flat[1] != u8"B=2" || rendered(flat).substr(11) != "B=2" || writes != 2)
+		throw failure("the deferred comment was not kept once accessed");
+}
+
 static ot::status try_parse_tags(const ogg_packet& packet)
 {
 	try {
@@ -92,6 +143,158 @@ static void parse_corrupted()
 		throw failure("did not detect the overflowing comment data");
 }
 
+/**
+ * Feed the parser with the packet cut in pieces of every size, and check that it gets the same
+ * result as #ot::parse_tags, including the errors on every truncated packet.
+ */
+static void parse_incrementally()
+{
+	std::string packet(standard_OpusTags, sizeof(standard_OpusTags) - 1);
+	packet += "\x00\x00\x00\x00"s "\x00\x00\x00\x00"s "\x01padding"s;
+	*reinterpret_cast<uint32_t*>(&packet[32]) = htole32(4);
+	ot::opus_tags expected = ot::parse_tags_view(packet);
+	for (size_t piece_size = 1; piece_size <= packet.size(); ++piece_size) {
+		ot::opus_tags tags;
+		ot::opus_tags_parser parser(tags);
+		for (size_t i = 0; i < packet.size(); i += piece_size)
+			parser.feed(ot::byte_string_view(packet).substr(i, piece_size));
+		parser.finish();
+		if (tags.vendor != expected.vendor ||
+		    std::list<std::u8string>(tags.comments) != std::list<std::u8string>(expected.comments) ||
+		    tags.extra_data != expected.extra_data || parser.size() != packet.size())
+			throw failure("bad parsing with pieces of " + std::to_string(piece_size) + " bytes");
+	}
+
+	for (size_t size = 0; size < packet.size(); ++size) {
+		ot::status expected_rc;
+		try {
+			ot::parse_tags_view(ot::byte_string_view(packet).substr(0, size));
+		} catch (const ot::status& rc) {
+			expected_rc = rc;
+		}
+		ot::status rc;
+		try {
+			ot::opus_tags tags;
+			ot::opus_tags_parser parser(tags, [](std::u8string_view) {});
+			parser.feed(ot::byte_string_view(packet).substr(0, size));
+			parser.finish();
+		} catch (const ot::status& e) {
+			rc = e;
+		}
+		if (rc != expected_rc.code || rc.message != expected_rc.message)
+			throw failure("bad error for a packet cut at " + std::to_string(size) + " bytes");
+	}
+}
+
+/** Write the given 32-bit integer in little-endian at the end of the string. */
+static void append_le32(std::string& out, uint32_t n)
+{
+	n = htole32(n);
+	out.append(reinterpret_cast<const char*>(&n), 4);
+}
+
+/**
+ * Write a stream made of a single OpusTags packet of count comments of comment_size bytes each,
+ * page by page, so that the packet is never held in memory. The pages are full, except the last
+ * one.
+ */
+static void write_giant_header(FILE* output, size_t count, size_t comment_size)
+{
+	std::string pending = "OpusTags"s;
+	append_le32(pending, 0);
+	append_le32(pending, count);
+	std::string comment(comment_size, 'x');
+	comment[0] = 'X';
+	comment[1] = '=';
+	size_t written = 0;
+	unsigned char header[27 + 255] = {'O', 'g', 'g', 'S'};
+	for (uint32_t pageno = 0;; ++pageno) {
+		for (; pending.size() < 255 * 255 && written < count; ++written) {
+			append_le32(pending, comment_size);
+			pending += comment;
+		}
+		bool last = written == count && pending.size() < 255 * 255;
+		size_t body_len = last ? pending.size() : 255 * 255;
+		size_t segments = last ? body_len / 255 + 1 : 255;
+		header[5] = pageno == 0 ? 0x02 : 0x01;
+		uint64_t granulepos = htole64(last ? 0 : -1);
+		memcpy(header + 6, &granulepos, 8);
+		uint32_t le_pageno = htole32(pageno);
+		memcpy(header + 18, &le_pageno, 4);
+		header[26] = segments;
+		memset(header + 27, 255, segments);
+		if (last)
+			header[27 + segments - 1] = body_len % 255;
+		ogg_page page;
+		page.header = header;
+		page.header_len = 27 + segments;
+		page.body = reinterpret_cast<unsigned char*>(pending.data());
+		page.body_len = body_len;
+		ot::set_page_checksum(page);
+		fwrite(page.header, 1, page.header_len, output);
+		fwrite(page.body, 1, page.body_len, output);
+		pending.erase(0, body_len);
+		if (last)
+			break;
+	}
+}
+
+/** Peak resident set size of the process, in bytes. */
+static size_t max_rss()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return usage.ru_maxrss * 1024;
+#endif
+}
+
+/**
+ * Parse a 256 MiB OpusTags packet read from a pipe, and check that the peak memory usage grows by
+ * much less than that.
+ */
+static void parse_giant_header()
+{
+	size_t count = 4096;
+	size_t comment_size = 64 << 10;
+	int fds[2];
+	if (pipe(fds) == -1)
+		throw failure("could not create a pipe");
+	ot::file input = fdopen(fds[0], "r");
+	std::thread writer([&] {
+		ot::file output = fdopen(fds[1], "w");
+		write_giant_header(output.get(), count, comment_size);
+	});
+
+	size_t rss_before = max_rss();
+	ot::opus_tags tags;
+	size_t comments = 0;
+	ot::opus_tags_parser parser(tags, [&](std::u8string_view comment) {
+		if (comment.size() != comment_size || !comment.starts_with(u8"X=x") || !comment.ends_with(u8"xx"))
+			throw failure("bad comment #" + std::to_string(comments));
+		++comments;
+	});
+	ot::ogg_reader reader(input.get());
+	try {
+		if (!reader.next_page())
+			throw failure("could not read the first page");
+		reader.process_header_pages([&](ot::byte_string_view piece) { parser.feed(piece); });
+		parser.finish();
+	} catch (...) {
+		input.reset(); // Unblock the writer.
+		writer.join();
+		throw;
+	}
+	writer.join();
+	if (comments != count || parser.size() != 16 + count * (4 + comment_size))
+		throw failure("bad number of comments");
+	size_t growth = max_rss() - rss_before;
+	if (growth > 32 << 20)
+		throw failure("the peak memory usage grew by " + std::to_string(growth >> 20) + " MiB");
+}
+
 static void recode_standard()
 {
 	ogg_packet op;
@@ -135,6 +338,35 @@ static void recode_padding()
 		throw failure("the rendered packet is not what we expected");
 }
 
+static void resize_padding()
+{
+	ot::opus_tags tags;
+	tags.vendor = u8"opustags";
+	tags.comments = { u8"TITLE=Foo" };
+	// 8 (OpusTags) + 4 + 8 (vendor) + 4 (count) + 4 + 9 (comment) = 37 bytes before the padding.
+	if (ot::resize_padding(tags, 40))
+		throw failure("created padding out of nothing");
+	if (!ot::resize_padding(tags, 37))
+		throw failure("did not accept the current size without padding");
+
+	tags.extra_data = "\0\0\0"s;
+	if (!ot::resize_padding(tags, 50))
+		throw failure("could not grow the padding");
+	opaque_is(tags.extra_data, std::string(13, '\0'), "grown padding");
+	if (ot::render_tags(tags).bytes != 50)
+		throw failure("the rendered packet does not have the requested size");
+	if (!ot::resize_padding(tags, 38))
+		throw failure("could not shrink the padding");
+	opaque_is(tags.extra_data, "\0"s, "shrunk padding");
+	if (ot::resize_padding(tags, 36))
+		throw failure("shrunk the comments themselves");
+
+	tags.extra_data = "\x01preserved"s;
+	if (ot::resize_padding(tags, 60))
+		throw failure("resized data that must be preserved");
+	opaque_is(tags.extra_data, "\x01preserved"s, "untouched binary data");
+}
+
 static void extract_cover()
 {
 	ot::byte_string_view picture_data = ""sv
@@ -157,12 +389,27 @@ static void extract_cover()
 	if (cover->picture_data != "Picture data"sv)
 		throw failure("bad extracted picture data");
 
+	std::optional<ot::cover_view> view = ot::find_cover(tags);
+	if (!view || view->mime_type != "image/foo"sv || view->picture_size != 12)
+		throw failure("bad cover view");
+	std::string streamed;
+	view->read_picture([&](ot::byte_string_view chunk) {
+		if (chunk.size() > 5)
+			throw failure("chunk larger than requested");
+		streamed += chunk;
+	}, 5);
+	opaque_is(streamed, "Picture data"sv, "streamed picture data");
+
 	ot::byte_string_view truncated_data = picture_data.substr(0, picture_data.size() - 1);
 	tags.comments = { u8"METADATA_BLOCK_PICTURE=" + ot::encode_base64(truncated_data) };
 	try {
 		ot::extract_cover(tags);
 		throw failure("accepted a bad picture block");
 	} catch (const ot::status& rc) {}
+	try {
+		ot::find_cover(tags);
+		throw failure("accepted a bad picture block without decoding it");
+	} catch (const ot::status& rc) {}
 }
 
 static void make_cover()
@@ -181,14 +428,50 @@ static void make_cover()
 	opaque_is(ot::make_cover("\x89PNG Picture data"sv), expected, "build the picture tag");
 }
 
+static void match_tags()
+{
+	ot::byte_string_view packet(standard_OpusTags, sizeof(standard_OpusTags) - 1);
+	auto match = [&](std::vector<ot::comment_selector> selectors) {
+		return ot::match_tags(packet, selectors);
+	};
+	if (!match({}))
+		throw failure("an empty filter should match everything");
+	if (!match({{u8"title"}}) || !match({{u8"TITLE=Foo"}}) || !match({{u8"Artist=B", true}}))
+		throw failure("did not match single selectors");
+	if (!match({{u8"artist=Bar"}, {u8"TITLE"}}))
+		throw failure("did not match all the selectors");
+	if (match({{u8"TITLE=foo"}}) || match({{u8"TITLE=Fo"}}) || match({{u8"TITL"}}) ||
+	    match({{u8"ARTIST=Bart", true}}))
+		throw failure("matched a wrong selector");
+	if (match({{u8"TITLE"}, {u8"ALBUM"}}))
+		throw failure("matched only one of the selectors");
+
+	// The comments after a decisive match are not even looked at.
+	ot::byte_string truncated(packet.substr(0, packet.size() - 4));
+	if (!ot::match_tags(truncated, {{u8"TITLE"}}))
+		throw failure("did not match before the truncated comment");
+	try {
+		ot::match_tags(truncated, {{u8"ALBUM"}});
+		throw failure("accepted a truncated packet");
+	} catch (const ot::status& rc) {
+		if (rc != ot::st::cut_comment_data)
+			throw failure("bad error code for a truncated packet");
+	}
+}
+
 int main()
 {
-	std::cout << "1..6\n";
+	std::cout << "1..11\n";
 	run(parse_standard, "parse a standard OpusTags packet");
+	run(edit_comments, "edit the comments in place");
 	run(parse_corrupted, "correctly reject invalid packets");
+	run(parse_incrementally, "parse a packet piece by piece");
+	run(parse_giant_header, "parse a giant packet in bounded memory");
 	run(recode_standard, "recode a standard OpusTags packet");
 	run(recode_padding, "recode a OpusTags packet with padding");
+	run(resize_padding, "resize the padding of a OpusTags packet");
 	run(extract_cover, "extract the cover art");
 	run(make_cover, "encode the cover art");
+	run(match_tags, "match the comments of a packet");
 	return 0;
 }
@@ -4,12 +4,13 @@ use strict;
 use warnings;
 use utf8;
 
-use Test::More tests => 66;
+use Test::More tests => 150;
 use Test::Deep qw(cmp_deeply re);
 
 use Digest::MD5;
 use File::Basename;
 use File::Copy;
+use File::Path qw(make_path remove_tree);
 use IPC::Open3;
 use List::MoreUtils qw(any);
 use Symbol 'gensym';
@@ -193,6 +194,14 @@ sub slurp {
 my $data = slurp 'out.opus';
 is_deeply(opustags('-', '-o', '-', {in => $data, mode => ':raw'}), [$data, '', 0], 'read opus from stdin and write to stdout');
 
+# The output may already contain data, which a clone of the input would wipe out.
+open(my $append, '>', 'out2.opus');
+print $append 'prefix';
+close($append);
+system("$opustags gobble.opus -o - >> out2.opus") == 0 or die;
+is(slurp('out2.opus'), 'prefix' . slurp('gobble.opus'), 'append the output to an existing file');
+unlink('out2.opus');
+
 unlink('out.opus');
 
 # Test --in-place
@@ -206,6 +215,161 @@ is(md5('out2.opus'), '0a4d20c287b2e46b26cb0eee353c2069', 'the tags were added co
 unlink('out.opus');
 unlink('out2.opus');
 
+# Test --jobs, making sure the errors are reported in the order of the input files.
+copy('gobble.opus', "out$_.opus") for 1..4;
+is_deeply(opustags(qw(--in-place -j 3 --add BAR=baz out1.opus missing1.opus out2.opus out3.opus missing2.opus out4.opus)),
+          ['', <<'EOF', 256], 'process multiple files with --jobs');
+missing1.opus: error: Could not open 'missing1.opus' for reading: No such file or directory
+missing2.opus: error: Could not open 'missing2.opus' for reading: No such file or directory
+EOF
+is(md5("out$_.opus"), 'f0c80c3f0dbb12819b0506531c326999', "the tags were added correctly (out$_.opus)") for 1..4;
+unlink("out$_.opus") for 1..4;
+
+# Test --recursive, which skips the files that are not Opus.
+make_path('tree/sub');
+copy('gobble.opus', 'tree/a.opus');
+copy('gobble.opus', 'tree/sub/b.ogg');
+copy('pixel.png', 'tree/pixel.png');
+is_deeply(opustags(qw(-iR --add BAR=baz tree)), ['', '', 0], 'process a directory with --recursive');
+is(md5('tree/a.opus'), 'f0c80c3f0dbb12819b0506531c326999', 'the tags were added correctly (tree/a.opus)');
+is(md5('tree/sub/b.ogg'), 'f0c80c3f0dbb12819b0506531c326999', 'the tags were added correctly (tree/sub/b.ogg)');
+is(md5('tree/pixel.png'), md5('pixel.png'), 'the non-Opus file was skipped');
+is_deeply(opustags(qw(-R tree --output-cover out.png)), ['', "error: Cannot use --output-cover with multiple input files.\n", 512], 'extract the covers of a directory');
+ok(!-e 'out.png', 'no cover was extracted');
+remove_tree('tree');
+
+# When the new header takes exactly the same space, --in-place patches the file without rewriting it.
+copy('gobble.opus', 'out.opus');
+my $inode = (stat 'out.opus')[1];
+is_deeply(opustags(qw(gobble.opus -o out2.opus -s), 'encoder=Lavc58.18.100 libopux'), ['', '', 0], 'copy with a same-size tag');
+is_deeply(opustags(qw(-i out.opus -s), 'encoder=Lavc58.18.100 libopux'), ['', '', 0], 'edit a same-size tag in place');
+is(md5('out.opus'), md5('out2.opus'), 'patching in place is equivalent to rewriting');
+is((stat 'out.opus')[1], $inode, 'the file was patched in place');
+is_deeply(opustags(qw(-i out.opus -a X=Y)), ['', '', 0], 'grow the header in place');
+isnt((stat 'out.opus')[1], $inode, 'the file was rewritten');
+unlink('out.opus');
+unlink('out2.opus');
+
+# After --padding, the size changes are absorbed by the padding so that the header keeps its size.
+is_deeply(opustags(qw(gobble.opus -o out.opus --padding 100)), ['', '', 0], 'reserve some padding');
+is(-s 'out.opus', (-s 'gobble.opus') + 100, 'the padding was added');
+$inode = (stat 'out.opus')[1];
+is_deeply(opustags(qw(-i out.opus -a TITLE=Gobble)), ['', '', 0], 'add a tag into the padding');
+is_deeply(opustags(qw(-i out.opus -D -a X=Y)), ['', '', 0], 'shrink the tags into the padding');
+is((stat 'out.opus')[1], $inode, 'the file was always patched in place');
+is_deeply(opustags(qw(-i out.opus -a), 'DATA=' . ('x' x 200), '--padding', 0), ['', '', 0], 'overflow the padding');
+is(-s 'out.opus', (-s 'gobble.opus') - (4 + 29) + (4 + 3) + (4 + 205), 'the padding was reset');
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i out.opus --padding 50)), ['', '', 0], 'reserve padding in place');
+is(-s 'out.opus', (-s 'gobble.opus') + 50, 'the padding was added in place');
+is_deeply(opustags(qw(-i out.opus --padding 4096)), ['', '', 0], 'grow the padding');
+# The packet takes 16 more lacing values.
+is(-s 'out.opus', (-s 'gobble.opus') + 4096 + 16, 'the padding was grown');
+is_deeply(opustags(qw(-i out.opus -a X=Y --padding 0)), ['', '', 0], 'remove the padding');
+is(-s 'out.opus', (-s 'gobble.opus') + 4 + 3, 'the padding was removed');
+unlink('out.opus');
+
+# The audio pages are copied without being parsed, but a truncated stream is still detected.
+copy('gobble.opus', 'out.opus');
+truncate('out.opus', (-s 'gobble.opus') - 1);
+is_deeply(opustags(qw(out.opus -a X=Y -o out2.opus)), ['', "out.opus: error: Unsynced data at end of stream.\n", 256], 'truncated stream');
+ok(! -e 'out2.opus', 'the output was discarded');
+is_deeply(opustags(qw(out.opus --link 1 -a X=Y -o out2.opus)), ['', "out.opus: error: Unsynced data at end of stream.\n", 256], 'truncated stream with a single link to edit');
+is_deeply(opustags(qw(-i out.opus --link 1 -s), 'encoder=Lavc58.18.100 libopux'), ['', "out.opus: error: Unsynced data at end of stream.\n", 256], 'truncated stream patched in place');
+is(slurp('out.opus'), substr(slurp('gobble.opus'), 0, -1), 'the truncated file was left untouched');
+unlink('out.opus');
+
+# Their framing is still followed, so garbage in the middle of the stream is reported too.
+my $corrupt = slurp('gobble.opus');
+substr($corrupt, index($corrupt, 'OggS', 100), 4) = 'OggX';
+open(my $fh, '>', 'out.opus') or die; binmode($fh); print $fh $corrupt; close($fh);
+is_deeply(opustags(qw(out.opus -a X=Y -o out2.opus)), ['', "out.opus: error: Unsynced data in stream.\n", 256], 'corrupted stream');
+ok(! -e 'out2.opus', 'the output was discarded');
+unlink('out.opus');
+
+# Test --catalog, with a same-size edit that preserves the modification time to prove that the
+# catalog is used.
+copy('gobble.opus', 'out.opus');
+utime(1000000000, 1000000000, 'out.opus');
+is_deeply(opustags(qw(out.opus --catalog catalog.bin)), [<<'EOF', '', 0], 'list the tags with a new catalog');
+encoder=Lavc58.18.100 libopus
+EOF
+ok(-s 'catalog.bin', 'the catalog was saved');
+is_deeply(opustags(qw(-i out.opus -s), 'encoder=Lavc58.18.100 libopux'), ['', '', 0], 'edit a same-size tag in place');
+utime(1000000000, 1000000000, 'out.opus');
+is_deeply(opustags(qw(out.opus --catalog catalog.bin)), [<<'EOF', '', 0], 'list the tags from the catalog');
+encoder=Lavc58.18.100 libopus
+EOF
+utime(1000000001, 1000000001, 'out.opus');
+is_deeply(opustags(qw(out.opus --catalog catalog.bin)), [<<'EOF', '', 0], 'read the modified file again');
+encoder=Lavc58.18.100 libopux
+EOF
+copy('gobble.opus', 'out2.opus');
+is_deeply(opustags(qw(out.opus out2.opus --catalog catalog.bin --vendor)), [<<'EOF', '', 0], 'list two files with the catalog');
+out.opus:Lavf58.12.100
+out2.opus:Lavf58.12.100
+EOF
+my $catalog_size = -s 'catalog.bin';
+is_deeply(opustags(qw(out.opus --catalog catalog.bin --vendor)), ["Lavf58.12.100\n", '', 0], 'list one of them');
+is(-s 'catalog.bin', $catalog_size, 'the other entry was kept');
+is_deeply(opustags(qw(out.opus --catalog catalog.bin --prune-catalog --vendor)), ["Lavf58.12.100\n", '', 0], 'prune the catalog');
+ok(-s 'catalog.bin' < $catalog_size, 'the other entry was dropped');
+unlink('out.opus', 'out2.opus');
+unlink('catalog.bin');
+
+# List several files at once.
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i out.opus -a), "X=multi\nline"), ['', '', 0], 'add a multi-line tag');
+is_deeply(opustags(qw(gobble.opus out.opus missing.opus)), [<<'EOF', <<'EOF', 256], 'list several files');
+gobble.opus:encoder=Lavc58.18.100 libopus
+out.opus:encoder=Lavc58.18.100 libopus
+out.opus:X=multi
+out.opus:	line
+EOF
+missing.opus: error: Could not open 'missing.opus' for reading: No such file or directory
+EOF
+is_deeply(opustags(qw(-H --vendor gobble.opus)), ["gobble.opus:Lavf58.12.100\n", '', 0], 'print the file name of a single file');
+unlink('out.opus');
+
+# Check the integrity of the files.
+my $gobble = slurp 'gobble.opus';
+substr($gobble, 500, 1) ^= "\x01";
+is_deeply(opustags('--verify', 'gobble.opus', '-', {in => $gobble, mode => ':raw'}), ['', <<'EOF', 256], 'verify the files');
+-: error: Invalid page at offset 137: CRC mismatch.
+EOF
+
+# Filter the files by their tags.
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i out.opus -a ARTIST=Someone -a TITLE=Something)), ['', '', 0], 'add tags to filter');
+is_deeply(opustags(qw(--match artist gobble.opus out.opus)), ["out.opus\n", '', 0], 'match an existing field');
+is_deeply(opustags(qw(--match ARTIST=Someone --match-prefix title=Some gobble.opus out.opus)), ["out.opus\n", '', 0], 'match a value and a prefix');
+is_deeply(opustags(qw(--match encoder --match title=Some gobble.opus out.opus)), ['', '', 0], 'match nothing');
+unlink('out.opus');
+
+is_deeply(opustags(qw(gobble.opus --json)), [<<'EOF', '', 0], 'print the tags as JSON');
+{"path":"gobble.opus","vendor":"Lavf58.12.100","comments":[["encoder","Lavc58.18.100 libopus"]],"extra_data":0,"bytes_read":1191,"cover":null}
+EOF
+
+# Announce a second comment that the packet does not contain, so that the error comes after the
+# first comment was parsed.
+{
+	my $data = slurp 'gobble.opus';
+	my $offset = 27 + ord(substr($data, 26, 1));
+	$offset += $_ for unpack('C*', substr($data, 27, $offset - 27));
+	my $header_len = 27 + ord(substr($data, $offset + 26, 1));
+	my $body_len = 0;
+	$body_len += $_ for unpack('C*', substr($data, $offset + 27, $header_len - 27));
+	substr($data, $offset + $header_len + 25, 4) = pack('V', 2);
+	substr($data, $offset + 22, 4) = "\0\0\0\0";
+	substr($data, $offset + 22, 4) = pack('V', ogg_crc(substr($data, $offset, $header_len + $body_len)));
+	open(my $fh, '>', 'out.opus') or die;
+	binmode($fh);
+	print $fh $data;
+	close($fh);
+}
+is_deeply(opustags(qw(out.opus --json)), ['', "out.opus: error: Comment length did not fit the comment header\n", 256], 'no partial JSON for invalid tags');
+unlink('out.opus');
+
 ####################################################################################################
 # Interactive edition
 
@@ -229,11 +393,102 @@ unlink("'screaming !'.opus");
 system('ffmpeg -loglevel error -y -i gobble.opus -c copy -map 0:0 -map 0:0 -shortest muxed.ogg') == 0
 	or BAIL_OUT('could not create a muxed stream');
 
-is_deeply(opustags('muxed.ogg'), ['', <<'END_ERR', 256], 'muxed streams detection');
-muxed.ogg: error: Muxed streams are not supported yet.
-END_ERR
+is_deeply(opustags('muxed.ogg'), [<<'END_OUT', '', 0], 'list the tags of the first Opus stream');
+encoder=Lavc58.18.100 libopus
+END_OUT
+
+is_deeply(opustags(qw(muxed.ogg -o out.ogg -a ARTIST=Someone)), ['', '', 0], 'edit a muxed file');
+is_deeply(opustags('out.ogg'), [<<'END_OUT', '', 0], 'only the first stream was edited');
+encoder=Lavc58.18.100 libopus
+ARTIST=Someone
+END_OUT
+is_deeply(opustags(qw(--verify out.ogg)), ['', '', 0], 'the edited muxed file is valid');
 
+is_deeply(opustags(qw(-i out.ogg -a), 'LONG=' . 'x' x 100000), ['', '', 0], 'grow the header of a muxed file');
+is_deeply(opustags(qw(--verify out.ogg)), ['', '', 0], 'only the first stream was renumbered');
+is_deeply(opustags(qw(-i out.ogg -D -a), 'encoder=Lavc58.18.100 libopus'), ['', '', 0], 'shrink the header of a muxed file');
+is(md5('out.ogg'), md5('muxed.ogg'), 'the muxed file was restored');
+
+# With a large comment header, the header pages of both streams are interleaved.
+is_deeply(opustags(qw(gobble.opus -o big.opus -a), 'LONG=' . 'x' x 100000), ['', '', 0], 'make a large comment header');
+system('ffmpeg -loglevel error -y -i big.opus -c copy -map 0:0 -map 0:0 -shortest muxed.ogg') == 0
+	or BAIL_OUT('could not create a muxed stream');
+is_deeply(opustags(qw(-i muxed.ogg -D -a), 'encoder=Lavc58.18.100 libopus'), ['', '', 0], 'edit interleaved header pages');
+is_deeply(opustags(qw(--verify muxed.ogg)), ['', '', 0], 'the interleaved pages were forwarded');
+is_deeply(opustags('muxed.ogg'), ["encoder=Lavc58.18.100 libopus\n", '', 0], 'the interleaved header was replaced');
+
+unlink('big.opus');
 unlink('muxed.ogg');
+unlink('out.ogg');
+
+####################################################################################################
+# Test chained streams
+
+sub ogg_crc {
+	my ($data) = @_;
+	my $crc = 0;
+	for my $byte (unpack('C*', $data)) {
+		$crc ^= $byte << 24;
+		$crc = (($crc & 0x80000000) ? ($crc << 1) ^ 0x04c11db7 : $crc << 1) & 0xffffffff for 1..8;
+	}
+	$crc
+}
+
+# Give a new serial number to all the pages of a single-stream Ogg file.
+sub reserial {
+	my ($data, $serialno) = @_;
+	my $result = '';
+	while (length($data) > 0) {
+		my $header_len = 27 + ord(substr($data, 26, 1));
+		my $body_len = 0;
+		$body_len += $_ for unpack('C*', substr($data, 27, $header_len - 27));
+		my $page = substr($data, 0, $header_len + $body_len, '');
+		substr($page, 14, 4) = pack('V', $serialno);
+		substr($page, 22, 4) = "\0\0\0\0";
+		substr($page, 22, 4) = pack('V', ogg_crc($page));
+		$result .= $page;
+	}
+	$result
+}
+
+my $link = slurp 'gobble.opus';
+open(my $chained, '>', 'chained.opus');
+binmode($chained);
+print $chained $link, reserial($link, 1), reserial($link, 2);
+close($chained);
+
+is_deeply(opustags('chained.opus'), ["encoder=Lavc58.18.100 libopus\n", '', 0], 'list the first link');
+is_deeply(opustags(qw(-i chained.opus --link 2 -a LINK=2)), ['', '', 0], 'edit the second link');
+is_deeply(opustags(qw(chained.opus --link 2)), [<<'END_OUT', '', 0], 'list the second link');
+encoder=Lavc58.18.100 libopus
+LINK=2
+END_OUT
+is_deeply(opustags(qw(-i chained.opus -a FIRST=1)), ['', '', 0], 'edit the first link by default');
+is_deeply(opustags(qw(chained.opus --link 2 --json)), [<<'END_OUT', '', 0], 'the other links were left untouched');
+{"path":"chained.opus","link":2,"vendor":"Lavf58.12.100","comments":[["encoder","Lavc58.18.100 libopus"],["LINK","2"]],"extra_data":0,"bytes_read":3594,"cover":null}
+END_OUT
+is_deeply(opustags(qw(-i chained.opus --link all -s), 'LONG=' . 'x' x 5000), ['', '', 0], 'edit all the links');
+is_deeply(opustags(qw(--verify chained.opus)), ['', '', 0], 'the chain is still valid');
+is_deeply(opustags(qw(chained.opus --link all -D -a X=Y --json)), [<<'END_OUT', '', 0], 'list all the links');
+{"path":"chained.opus","link":1,"vendor":"Lavf58.12.100","comments":[["X","Y"]],"extra_data":0,"bytes_read":12288,"cover":null}
+{"path":"chained.opus","link":2,"vendor":"Lavf58.12.100","comments":[["X","Y"]],"extra_data":0,"bytes_read":12288,"cover":null}
+{"path":"chained.opus","link":3,"vendor":"Lavf58.12.100","comments":[["X","Y"]],"extra_data":0,"bytes_read":18678,"cover":null}
+END_OUT
+is_deeply(opustags(qw(chained.opus --link 3 -d encoder)), ['LONG=' . 'x' x 5000 . "\n", '', 0], 'the last link was edited');
+is_deeply(opustags(qw(chained.opus --link 4)), ['', "chained.opus: error: Link 4 not found, the file has 3 links.\n", 256], 'missing link');
+
+# With padding, the last link could be patched in place, but not without the earlier edits.
+is_deeply(opustags(qw(gobble.opus --padding 4096 -o padded.opus)), ['', '', 0], 'pad a link');
+$link = slurp 'padded.opus';
+open($chained, '>', 'chained.opus');
+binmode($chained);
+print $chained $link, reserial($link, 1);
+close($chained);
+is_deeply(opustags(qw(-i chained.opus --link all -a NEW=1)), ['', '', 0], 'edit both padded links');
+is(-s 'chained.opus', 2 * length($link), 'the padding absorbed the edits');
+is_deeply(opustags(qw(chained.opus --link all)), ["# link 1\nencoder=Lavc58.18.100 libopus\nNEW=1\n# link 2\nencoder=Lavc58.18.100 libopus\nNEW=1\n", '', 0], 'both links were edited');
+
+unlink('chained.opus', 'padded.opus');
 
 ####################################################################################################
 # Locale
@@ -312,6 +567,7 @@ is_deeply(opustags(qw(--output-cover out.png out.opus)), [<<'END_OUT', '', 0], '
 METADATA_BLOCK_PICTURE=AAAAAwAAAAlpbWFnZS9wbmcAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAEWJUE5HDQoaCgAAAA1JSERSAAAAAQAAAAEIAgAAAJB3U94AAAAMSURBVAjXY/j//z8ABf4C/tzMWecAAAAASUVORK5CYII=
 END_OUT
 is(md5('out.png'), md5('pixel.png'), 'the extracted cover is identical to the one set');
+is_deeply(opustags(qw(--output-cover - out.opus), {mode => ':raw'}), [slurp('pixel.png'), '', 0], 'extract the cover to stdout');
 unlink('out.opus');
 unlink('out.png');
 
@@ -2,6 +2,7 @@
 #include "tap.h"
 
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 void check_partial_files()
@@ -46,6 +47,76 @@ void check_slurp()
 	opaque_is(ot::slurp_binary_file("pixel.png"), pixel, "loads a whole file");
 }
 
+void check_copy_file_tail()
+{
+	static const char* result = "copy_file_tail.test";
+	ot::file input = fopen("pixel.png", "re");
+	ot::file output = fopen(result, "we");
+	if (input == nullptr || output == nullptr)
+		throw failure("could not open the test files");
+	fputs("head", output.get());
+	fflush(output.get());
+	ot::copy_file_tail(fileno(input.get()), 8, fileno(output.get()));
+	output.reset();
+	opaque_is(ot::slurp_binary_file(result), "head" + ot::slurp_binary_file("pixel.png").substr(8),
+	          "copies the tail after the current output");
+	is(ftell(input.get()), 0, "the input position is unchanged");
+	is(remove(result), 0, "remove the result file");
+}
+
+void check_clone_file()
+{
+	static const char* result = "clone_file.test";
+	ot::file input = fopen("pixel.png", "re");
+	ot::file output = fopen(result, "we");
+	if (input == nullptr || output == nullptr)
+		throw failure("could not open the test files");
+	fputs("untouched", output.get());
+	fflush(output.get());
+	bool cloned = ot::clone_file(fileno(input.get()), fileno(output.get()));
+	output.reset();
+	// Cloning is only supported by a few file systems, so both outcomes are acceptable.
+	opaque_is(ot::slurp_binary_file(result),
+	          cloned ? ot::slurp_binary_file("pixel.png") : "untouched"s,
+	          "the output is either a clone or untouched");
+	is(remove(result), 0, "remove the result file");
+}
+
+void check_walk_directory()
+{
+	char root[] = "walk.XXXXXX";
+	if (mkdtemp(root) == nullptr)
+		throw failure("could not create a temporary directory");
+	std::string path = root;
+	mkdir((path + "/b").c_str(), 0700);
+	mkdir((path + "/b/c").c_str(), 0700);
+	for (auto file : {"/a", "/b/x", "/b/c/y", "/z"})
+		ot::file(fopen((path + file).c_str(), "w"));
+	symlink("b", (path + "/link").c_str());
+	symlink("..", (path + "/b/c/loop").c_str());
+
+	std::vector<std::string> files;
+	auto collect = [&](const std::string& file) { files.push_back(file.substr(path.size())); };
+	ot::walk_directory(path, false, collect);
+	if (files != std::vector<std::string>{"/a", "/b/c/y", "/b/x", "/z"})
+		throw failure("unexpected listing without following symbolic links");
+
+	files.clear();
+	ot::walk_directory(path, true, collect);
+	if (files != std::vector<std::string>{"/a", "/b/c/y", "/b/x", "/z"})
+		throw failure("unexpected listing when following symbolic links");
+
+	try {
+		ot::walk_directory(path + "/a", false, collect);
+		throw failure("walked a regular file");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::standard_error, "walking a regular file fails");
+	}
+
+	for (auto file : {"/b/c/loop", "/link", "/a", "/b/x", "/b/c/y", "/z", "/b/c", "/b", ""})
+		remove((path + file).c_str());
+}
+
 void check_converter()
 {
 	setlocale(LC_ALL, "");
@@ -69,9 +140,12 @@ void check_shell_esape()
 
 int main(int argc, char **argv)
 {
-	plan(4);
+	plan(7);
 	run(check_partial_files, "test partial files");
 	run(check_slurp, "file slurping");
+	run(check_copy_file_tail, "kernel-side file copy");
+	run(check_clone_file, "file cloning");
+	run(check_walk_directory, "directory walking");
 	run(check_converter, "test encoding converter");
 	run(check_shell_esape, "test shell escaping");
 	return 0;